@@ -0,0 +1,630 @@
+/** @file fork-server.cc
+ *
+ * A helper process which spawns children on behalf of R.
+ *
+ * The helper is forked from R once, when R's address space is still
+ * small, and from then on creates children with
+ * clone(CLONE_VM | CLONE_VFORK | CLONE_PARENT). The cost of spawning
+ * does not depend on the size of R's heap and, thanks to CLONE_PARENT,
+ * children are R's children: they can be waited for and signalled as
+ * if R spawned them itself.
+ *
+ * R sends spawn requests over a Unix socket, together with descriptors
+ * of redirected streams; the helper replies with the child's pid and
+ * passes R's ends of the pipes via SCM_RIGHTS.
+ */
+
+#include "config-os.h"
+#include "subprocess.h"
+
+#ifdef __linux__
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern char ** environ;
+
+#endif /* __linux__ */
+
+
+namespace subprocess {
+
+#ifdef __linux__
+
+/* followed by `length` bytes: command, workdir, arguments and
+ * environment, each terminated with a NUL */
+struct fork_request {
+  uint32_t length;
+  int32_t  termination_mode;
+  uint32_t argc;
+  uint32_t envc;
+  uint32_t streams;   /* STREAM_* flags */
+};
+
+/* bit `i` set: a descriptor for stream `i` is passed with the request,
+ * no pipe is created; STREAM_MERGE: stderr is the same as stdout */
+enum { STREAM_MERGE = 8 };
+
+struct fork_response {
+  int32_t error;    /* errno; 0 on success */
+  int32_t pid;      /* set if the child was created */
+};
+
+
+static pid_t server_pid = 0;
+static int server_socket = HANDLE_CLOSED;
+
+
+static bool write_all (int _fd, const void * _buffer, size_t _length)
+{
+  const char * buffer = static_cast<const char *>(_buffer);
+  while (_length > 0) {
+    ssize_t rc = send(_fd, buffer, _length, MSG_NOSIGNAL);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) return false;
+    buffer += rc;
+    _length -= rc;
+  }
+  return true;
+}
+
+
+static bool read_all (int _fd, void * _buffer, size_t _length)
+{
+  char * buffer = static_cast<char *>(_buffer);
+  while (_length > 0) {
+    ssize_t rc = ::read(_fd, buffer, _length);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) return false;
+    buffer += rc;
+    _length -= rc;
+  }
+  return true;
+}
+
+
+/* --- the helper process ------------------------------------------- */
+
+/*
+ * The helper might have been forked from a multi-threaded R session,
+ * so it does not use the C heap: memory comes from mmap() and the
+ * process exits via a system call.
+ */
+
+struct clone_arguments {
+  const char * command;
+  char ** arguments;
+  char ** environment;
+  const char * workdir;
+  bool new_session;
+  const int * streams;  /* connected to stdin, stdout, stderr */
+  int error;          /* written by the child, shares memory with helper */
+};
+
+
+static int clone_child (void * _arguments)
+{
+  clone_arguments & args = *static_cast<clone_arguments *>(_arguments);
+
+  // signals ignored by the helper should not be ignored by the child
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_DFL;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGQUIT, &action, NULL);
+  sigaction(SIGPIPE, &action, NULL);
+
+  // descriptors are O_CLOEXEC, dup2() clears the flag on standard
+  // streams; stderr is duplicated last so it can follow stdout
+  if (dup2(args.streams[PIPE_STDIN], STDIN_FILENO) < 0 ||
+      dup2(args.streams[PIPE_STDOUT], STDOUT_FILENO) < 0 ||
+      dup2(args.streams[PIPE_STDERR], STDERR_FILENO) < 0 ||
+      (args.workdir && chdir(args.workdir) < 0) ||
+      (args.new_session && setsid() == (pid_t)-1))
+  {
+    args.error = errno;
+  }
+  else {
+    execve(args.command, args.arguments, args.environment);
+    args.error = errno;
+  }
+
+  syscall(SYS_exit, 127);
+  return 127;
+}
+
+
+static void * map_memory (size_t _length)
+{
+  void * memory = mmap(NULL, _length, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return memory == MAP_FAILED ? NULL : memory;
+}
+
+
+static void send_response (int _socket, const fork_response & _response,
+                           const int * _fds, size_t _count)
+{
+  struct iovec iov;
+  iov.iov_base = const_cast<fork_response *>(&_response);
+  iov.iov_len  = sizeof(_response);
+
+  union {
+    char buffer[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+
+  if (!_response.error && _count) {
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(_count * sizeof(int));
+
+    struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type  = SCM_RIGHTS;
+    header->cmsg_len   = CMSG_LEN(_count * sizeof(int));
+    memcpy(CMSG_DATA(header), _fds, _count * sizeof(int));
+  }
+
+  while (sendmsg(_socket, &message, MSG_NOSIGNAL) < 0 && errno == EINTR);
+}
+
+
+static void serve_request (int _socket, const fork_request & _request, char * _payload,
+                           const int _passed[3])
+{
+  fork_response response = { 0, 0 };
+
+  // command, workdir, arguments..., NULL, environment..., NULL
+  size_t count = 2 + _request.argc + 1 + _request.envc + 1;
+  char ** strings = static_cast<char **>(map_memory(count * sizeof(char *)));
+  if (!strings) {
+    response.error = ENOMEM;
+    send_response(_socket, response, NULL, 0);
+    return;
+  }
+
+  char * position = _payload, * end = _payload + _request.length;
+  for (size_t i = 0; i < count; ++i) {
+    bool terminator = (i == 2 + _request.argc) || (i == count - 1);
+    if (terminator) {
+      strings[i] = NULL;
+      continue;
+    }
+    if (position >= end) {
+      response.error = EINVAL;
+      break;
+    }
+    strings[i] = position;
+    position += strlen(position) + 1;
+  }
+
+  // child's end of each stream: a passed descriptor or a new pipe
+  int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+  int streams[3];
+  for (int i = 0; i < 3 && !response.error; ++i) {
+    if (_passed[i] != -1) {
+      streams[i] = _passed[i];
+    }
+    else if (i == PIPE_STDERR && (_request.streams & STREAM_MERGE)) {
+      streams[i] = STDOUT_FILENO;
+    }
+    else if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+      response.error = errno;
+    }
+    else {
+      streams[i] = pipes[i][i == PIPE_STDIN ? 0 : 1];
+    }
+  }
+
+  if (!response.error) {
+    clone_arguments args;
+    args.command     = strings[0];
+    args.workdir     = strings[1];
+    args.arguments   = strings + 2;
+    args.environment = strings + 2 + _request.argc + 1;
+    args.new_session = _request.termination_mode == process_handle_t::TERMINATION_GROUP;
+    args.streams     = streams;
+    args.error       = 0;
+
+    static char stack[64 * 1024] __attribute__((aligned(16)));
+
+    // the helper is suspended until the child calls execve() or exits;
+    // the exit signal is sent to R, the new parent
+    pid_t pid = clone(clone_child, stack + sizeof(stack),
+                      CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &args);
+    if (pid < 0) {
+      response.error = errno;
+    }
+    else {
+      response.pid = pid;
+      response.error = args.error;
+    }
+  }
+
+  // only ends of pipes which have been created are passed back
+  int parent_ends[3];
+  size_t created = 0;
+  for (int i = 0; i < 3; ++i) {
+    int fd = pipes[i][i == PIPE_STDIN ? 1 : 0];
+    if (fd != -1) parent_ends[created++] = fd;
+  }
+  send_response(_socket, response, parent_ends, created);
+
+  for (int i = 0; i < 3; ++i) {
+    if (pipes[i][0] != -1) ::close(pipes[i][0]);
+    if (pipes[i][1] != -1) ::close(pipes[i][1]);
+  }
+  munmap(strings, count * sizeof(char *));
+}
+
+
+/* read the request header and descriptors passed along with it */
+static bool receive_request (int _socket, fork_request & _request, int _passed[3])
+{
+  struct iovec iov;
+  iov.iov_base = &_request;
+  iov.iov_len  = sizeof(_request);
+
+  union {
+    char buffer[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+
+  ssize_t rc;
+  while ((rc = recvmsg(_socket, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+  if (rc <= 0) {
+    return false;
+  }
+
+  // descriptors arrive with the first byte; the rest might come later
+  int fds[3], count = 0;
+  struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+  if (header && header->cmsg_type == SCM_RIGHTS) {
+    count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(header), count * sizeof(int));
+  }
+
+  if ((size_t)rc < sizeof(_request) &&
+      !read_all(_socket, reinterpret_cast<char *>(&_request) + rc, sizeof(_request) - rc))
+  {
+    return false;
+  }
+
+  for (int i = 0, j = 0; i < 3; ++i) {
+    _passed[i] = (_request.streams & (1u << i)) && j < count ? fds[j++] : -1;
+  }
+  return true;
+}
+
+
+static void serve (int _socket)
+{
+  while (true) {
+    fork_request request;
+    int passed[3];
+    if (!receive_request(_socket, request, passed)) {
+      return;   // R closed the socket
+    }
+
+    char * payload = static_cast<char *>(map_memory(request.length + 1));
+    if (!payload || !read_all(_socket, payload, request.length)) {
+      return;
+    }
+    payload[request.length] = 0;
+
+    serve_request(_socket, request, payload, passed);
+    munmap(payload, request.length + 1);
+
+    for (int i = 0; i < 3; ++i) {
+      if (passed[i] != -1) ::close(passed[i]);
+    }
+  }
+}
+
+
+/* body of the helper process right after fork() */
+static void run_helper (int _socket)
+{
+  // keep standard streams and the socket, close whatever R has open
+  close_descriptors(&_socket, 1);
+
+  // R's handlers must not run here; Ctrl+C is meant for R and children
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_IGN;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGQUIT, &action, NULL);
+  sigaction(SIGPIPE, &action, NULL);
+
+  action.sa_handler = SIG_DFL;
+  int defaults[] = { SIGCHLD, SIGHUP, SIGTERM, SIGUSR1, SIGUSR2, SIGALRM };
+  for (int signal : defaults) {
+    sigaction(signal, &action, NULL);
+  }
+
+  serve(_socket);
+  syscall(SYS_exit_group, 0);
+}
+
+
+/* --- R side ------------------------------------------------------- */
+
+bool fork_server_start ()
+{
+  if (server_pid) {
+    return false;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+    throw subprocess_exception(errno, "could not create a socket");
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    int code = errno;
+    ::close(fds[0]);
+    ::close(fds[1]);
+    throw subprocess_exception(code, "could not start fork server");
+  }
+
+  if (pid == 0) {
+    run_helper(fds[1]);
+  }
+
+  ::close(fds[1]);
+  server_pid = pid;
+  server_socket = fds[0];
+  return true;
+}
+
+
+bool fork_server_stop ()
+{
+  if (!server_pid) {
+    return false;
+  }
+
+  // the helper exits when the socket is closed
+  ::close(server_socket);
+  server_socket = HANDLE_CLOSED;
+
+  while (waitpid(server_pid, NULL, 0) < 0 && errno == EINTR);
+  server_pid = 0;
+  return true;
+}
+
+
+bool fork_server_running ()
+{
+  return server_pid != 0;
+}
+
+
+/* send the request header with `_count` descriptors attached */
+static bool send_request (int _socket, const fork_request & _request,
+                          const int * _fds, size_t _count)
+{
+  if (!_count) {
+    return write_all(_socket, &_request, sizeof(_request));
+  }
+
+  struct iovec iov;
+  iov.iov_base = const_cast<fork_request *>(&_request);
+  iov.iov_len  = sizeof(_request);
+
+  union {
+    char buffer[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = CMSG_SPACE(_count * sizeof(int));
+
+  struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type  = SCM_RIGHTS;
+  header->cmsg_len   = CMSG_LEN(_count * sizeof(int));
+  memcpy(CMSG_DATA(header), _fds, _count * sizeof(int));
+
+  ssize_t rc;
+  while ((rc = sendmsg(_socket, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+  if (rc < 0) {
+    return false;
+  }
+
+  // descriptors went with the first byte, the rest is plain data
+  return write_all(_socket, reinterpret_cast<const char *>(&_request) + rc,
+                   sizeof(_request) - rc);
+}
+
+
+static void append_string (string & _payload, const char * _string)
+{
+  _payload.append(_string);
+  _payload.push_back(0);
+}
+
+
+pid_t fork_server_spawn (const char * _command, char *const _arguments[],
+                         char *const _environment[], const char * _workdir,
+                         process_handle_t::termination_mode_type _termination_mode,
+                         const int _streams[3], pipe_handle_type _pipes[3])
+{
+  if (!server_pid) {
+    errno = ESRCH;
+    return -1;
+  }
+
+  // children inherit R's current directory and environment rather
+  // than those of the helper
+  string workdir;
+  if (_workdir) {
+    workdir = _workdir;
+  }
+  else {
+    vector<char> buffer(4096);
+    while (!getcwd(buffer.data(), buffer.size())) {
+      if (errno != ERANGE) {
+        throw subprocess_exception(errno, "could not determine working directory");
+      }
+      buffer.resize(buffer.size() * 2);
+    }
+    workdir = buffer.data();
+  }
+
+  if (!_environment) {
+    _environment = environ;
+  }
+
+  fork_request request = { 0, _termination_mode, 0, 0, 0 };
+
+  // redirected streams travel with the request header
+  int passed[3];
+  size_t count = 0;
+  for (int i = 0; i < 3; ++i) {
+    if (i == PIPE_STDERR && _streams[i] == STDOUT_FILENO) {
+      request.streams |= STREAM_MERGE;
+    }
+    else if (_streams[i] != HANDLE_CLOSED) {
+      request.streams |= 1u << i;
+      passed[count++] = _streams[i];
+    }
+  }
+
+  string payload;
+
+  append_string(payload, _command);
+  append_string(payload, workdir.c_str());
+  for (char *const * argument = _arguments; *argument; ++argument, ++request.argc) {
+    append_string(payload, *argument);
+  }
+  for (char *const * variable = _environment; *variable; ++variable, ++request.envc) {
+    append_string(payload, *variable);
+  }
+  request.length = static_cast<uint32_t>(payload.size());
+
+  // the helper is gone; errno tells the caller what happened
+  if (!send_request(server_socket, request, passed, count) ||
+      !write_all(server_socket, payload.data(), payload.size()))
+  {
+    int code = errno;
+    fork_server_stop();
+    errno = code;
+    return -1;
+  }
+
+  fork_response response;
+  struct iovec iov;
+  iov.iov_base = &response;
+  iov.iov_len  = sizeof(response);
+
+  union {
+    char buffer[CMSG_SPACE(3 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+
+  ssize_t rc;
+  while ((rc = recvmsg(server_socket, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+  if (rc != sizeof(response)) {
+    int code = rc < 0 ? errno : EPIPE;
+    fork_server_stop();
+    errno = code;
+    return -1;
+  }
+
+  // the child was created but could not run the command
+  if (response.pid > 0 && response.error) {
+    while (waitpid(response.pid, NULL, 0) < 0 && errno == EINTR);
+    throw subprocess_exception(response.error, string("could not run command ") + _command);
+  }
+  if (response.error) {
+    errno = response.error;
+    return -1;
+  }
+
+  // one pipe for each stream which has not been redirected
+  size_t expected = 0;
+  for (int i = 0; i < 3; ++i) {
+    _pipes[i] = HANDLE_CLOSED;
+    if (_streams[i] == HANDLE_CLOSED) ++expected;
+  }
+
+  if (expected) {
+    struct cmsghdr * header = CMSG_FIRSTHDR(&message);
+    if (!header || header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(expected * sizeof(int)))
+    {
+      throw subprocess_exception(EPROTO, "fork server did not pass pipes");
+    }
+
+    int fds[3];
+    memcpy(fds, CMSG_DATA(header), expected * sizeof(int));
+    for (int i = 0, j = 0; i < 3; ++i) {
+      if (_streams[i] == HANDLE_CLOSED) _pipes[i] = fds[j++];
+    }
+  }
+
+  return response.pid;
+}
+
+
+#else /* !__linux__ */
+
+
+bool fork_server_start ()
+{
+  throw subprocess_exception(ENOTSUP, "fork server is supported only in Linux");
+}
+
+bool fork_server_stop () { return false; }
+
+bool fork_server_running () { return false; }
+
+pid_t fork_server_spawn (const char *, char *const [], char *const [], const char *,
+                         process_handle_t::termination_mode_type, const int [3],
+                         pipe_handle_type [3])
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+#endif /* __linux__ */
+
+} /* namespace subprocess */
@@ -0,0 +1,603 @@
+/** @file process-pool.cc
+ *
+ * A pool of long-lived workers fed from a native queue.
+ *
+ * A scheduler thread polls pipes of all workers at once: it writes
+ * requests into standard input of workers as soon as a pipe can take
+ * them and parses responses as soon as they arrive, so the throughput
+ * does not depend on how often R looks at the pool. R only queues
+ * requests and takes completed results.
+ *
+ * Workers are started and replaced in R's thread; the scheduler only
+ * marks a worker whose output has ended as dead and from then on does
+ * not touch it until restart() puts a new child in its place.
+ */
+
+#include "config-os.h"
+#include "subprocess.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+
+namespace subprocess {
+
+
+/* a single read from a worker takes at most this much */
+static const size_t read_chunk = 65536;
+
+/* milliseconds workers have to exit after their input is closed */
+static const int shutdown_grace = 100;
+
+
+struct process_pool::state {
+
+  struct worker {
+    std::unique_ptr<process_handle_t> handle;
+
+    /* encoded requests; the first `written` bytes have been sent */
+    vector<char> output;
+    size_t written;
+
+    /* response being received; the first `scanned` bytes hold no
+     * end of a line */
+    vector<char> input;
+    size_t scanned;
+
+    /* ids of requests sent and not answered yet, oldest first */
+    std::deque<uint64_t> tasks;
+
+    uint64_t completed;
+    bool alive;
+
+    worker () : written(0), scanned(0), completed(0), alive(false) { }
+  };
+
+  /* how workers are started, kept for restarts */
+  string command, workdir, stderr_path;
+  vector<string> arguments, environment;
+  process_handle_t::termination_mode_type termination_mode;
+  spawn_options options;
+
+  protocol_type protocol;
+  size_t inflight;
+
+  vector<worker> workers;
+  std::deque<std::pair<uint64_t, vector<char> > > queue;
+  std::deque<result> results;
+
+  uint64_t submitted, completed, failed, restarts;
+  std::chrono::steady_clock::time_point start;
+
+  int wakeup[2];
+  int error;
+  bool stopped;
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::thread thread;
+
+  state () : submitted(0), completed(0), failed(0), restarts(0), error(0), stopped(false)
+  {
+    wakeup[0] = wakeup[1] = HANDLE_CLOSED;
+  }
+
+  ~state ()
+  {
+    for (int fd : wakeup) {
+      if (fd != HANDLE_CLOSED) ::close(fd);
+    }
+  }
+
+  /* interrupt poll() in the scheduler thread */
+  void wake ()
+  {
+    char byte = 0;
+    ssize_t rc = ::write(wakeup[1], &byte, 1);
+    (void)rc;
+  }
+
+  void spawn (worker & _worker);
+  void dispatch ();
+  void send (worker & _worker);
+  void receive (worker & _worker, size_t _index, vector<char> & _chunk);
+  void parse (worker & _worker, size_t _index);
+  void lost (worker & _worker, size_t _index);
+  void run ();
+
+  size_t running () const
+  {
+    size_t count = 0;
+    for (const worker & w : workers) count += w.tasks.size();
+    return count;
+  }
+
+  bool any_dead () const
+  {
+    for (const worker & w : workers) {
+      if (!w.alive) return true;
+    }
+    return false;
+  }
+};
+
+
+void process_pool::state::spawn (worker & _worker)
+{
+  vector<char *> argv, envp;
+  argv.push_back(const_cast<char *>(command.c_str()));
+  for (string & argument : arguments) argv.push_back(&argument[0]);
+  argv.push_back(nullptr);
+
+  for (string & variable : environment) envp.push_back(&variable[0]);
+  envp.push_back(nullptr);
+
+  spawn_options current = options;
+  if (current.redirect[PIPE_STDERR] == spawn_options::REDIRECT_FILE) {
+    current.redirect_path[PIPE_STDERR] = stderr_path.c_str();
+  }
+
+  std::unique_ptr<process_handle_t> handle(new process_handle_t());
+  handle->spawn(command.c_str(), argv.data(), environment.empty() ? nullptr : envp.data(),
+                workdir.empty() ? nullptr : workdir.c_str(), termination_mode, current);
+
+  _worker.handle.swap(handle);
+  _worker.output.clear();
+  _worker.input.clear();
+  _worker.written = _worker.scanned = 0;
+  _worker.tasks.clear();
+  _worker.alive = true;
+}
+
+
+/* the worker with the fewest requests in flight takes the next one */
+void process_pool::state::dispatch ()
+{
+  while (!queue.empty()) {
+    worker * best = nullptr;
+    for (worker & w : workers) {
+      if (!w.alive || w.tasks.size() >= inflight) continue;
+      if (!best || w.tasks.size() < best->tasks.size() ||
+          (w.tasks.size() == best->tasks.size() && w.completed < best->completed))
+      {
+        best = &w;
+      }
+    }
+    if (!best) break;
+
+    const vector<char> & request = queue.front().second;
+    best->output.insert(best->output.end(), request.begin(), request.end());
+    best->tasks.push_back(queue.front().first);
+    queue.pop_front();
+  }
+}
+
+
+void process_pool::state::send (worker & _worker)
+{
+  while (_worker.written < _worker.output.size()) {
+    ssize_t rc = ::write(_worker.handle->pipe_stdin, _worker.output.data() + _worker.written,
+                         _worker.output.size() - _worker.written);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0 && errno == EAGAIN) break;
+
+    // the worker does not read anymore; its end shows in its output
+    if (rc < 0) {
+      _worker.output.clear();
+      _worker.written = 0;
+      return;
+    }
+    _worker.written += static_cast<size_t>(rc);
+  }
+
+  if (_worker.written == _worker.output.size()) {
+    _worker.output.clear();
+    _worker.written = 0;
+  }
+  else if (_worker.written >= read_chunk && _worker.written * 2 >= _worker.output.size()) {
+    _worker.output.erase(_worker.output.begin(), _worker.output.begin() + _worker.written);
+    _worker.written = 0;
+  }
+}
+
+
+void process_pool::state::receive (worker & _worker, size_t _index, vector<char> & _chunk)
+{
+  while (true) {
+    ssize_t rc = ::read(_worker.handle->pipe_stdout, _chunk.data(), _chunk.size());
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0 && errno == EAGAIN) break;
+    if (rc <= 0) {
+      parse(_worker, _index);
+      lost(_worker, _index);
+      return;
+    }
+
+    _worker.input.insert(_worker.input.end(), _chunk.data(), _chunk.data() + rc);
+
+    // a short read means the pipe has been emptied
+    if (static_cast<size_t>(rc) < _chunk.size()) break;
+  }
+
+  parse(_worker, _index);
+}
+
+
+void process_pool::state::parse (worker & _worker, size_t _index)
+{
+  const char * data = _worker.input.data();
+  size_t size = _worker.input.size(), offset = 0;
+  bool any = false;
+
+  while (offset < size) {
+    size_t begin = offset, end, next;
+    if (protocol == PROTOCOL_LINE) {
+      size_t from = std::max(offset, _worker.scanned);
+      const char * eol = (const char *)memchr(data + from, '\n', size - from);
+      if (!eol) {
+        _worker.scanned = size;
+        break;
+      }
+      end  = static_cast<size_t>(eol - data);
+      next = end + 1;
+    }
+    else {
+      if (size - offset < 4) break;
+      const unsigned char * header = (const unsigned char *)data + offset;
+      size_t length = (size_t(header[0]) << 24) | (size_t(header[1]) << 16) |
+                      (size_t(header[2]) << 8) | size_t(header[3]);
+      if (size - offset - 4 < length) break;
+      begin = offset + 4;
+      end   = begin + length;
+      next  = end;
+    }
+
+    // output nobody asked for is dropped
+    if (!_worker.tasks.empty()) {
+      result response;
+      response.id = _worker.tasks.front();
+      response.worker = _index;
+      response.failed = false;
+      response.data.assign(data + begin, data + end);
+      results.push_back(std::move(response));
+
+      _worker.tasks.pop_front();
+      ++_worker.completed;
+      ++completed;
+      any = true;
+    }
+    offset = next;
+  }
+
+  if (offset > 0) {
+    _worker.input.erase(_worker.input.begin(), _worker.input.begin() + offset);
+    _worker.scanned = (_worker.scanned > offset) ? _worker.scanned - offset : 0;
+  }
+  if (any) {
+    ready.notify_all();
+  }
+}
+
+
+/* requests sent to a worker which exited fail */
+void process_pool::state::lost (worker & _worker, size_t _index)
+{
+  for (uint64_t id : _worker.tasks) {
+    result response;
+    response.id = id;
+    response.worker = _index;
+    response.failed = true;
+    results.push_back(std::move(response));
+    ++failed;
+  }
+
+  _worker.tasks.clear();
+  _worker.output.clear();
+  _worker.input.clear();
+  _worker.written = _worker.scanned = 0;
+  _worker.alive = false;
+
+  ready.notify_all();
+}
+
+
+/* body of the scheduler thread */
+void process_pool::state::run ()
+{
+  // a write to a worker which exited reports EPIPE; the signal stays
+  // pending in this thread and is gone together with it
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+  vector<char> chunk(read_chunk);
+  vector<struct pollfd> fds(1 + 2 * workers.size());
+
+  std::unique_lock<std::mutex> lock(mutex);
+  while (!stopped) {
+    dispatch();
+
+    // stdin and stdout of each worker; -1 is ignored by poll()
+    fds[0] = { wakeup[0], POLLIN, 0 };
+    for (size_t i = 0; i < workers.size(); ++i) {
+      worker & w = workers[i];
+      bool sending = w.alive && w.written < w.output.size();
+      fds[1 + 2 * i] = { sending ? w.handle->pipe_stdin : -1, POLLOUT, 0 };
+      fds[2 + 2 * i] = { w.alive ? w.handle->pipe_stdout : -1, POLLIN, 0 };
+    }
+
+    lock.unlock();
+    int rc = poll(fds.data(), fds.size(), -1);
+    int code = errno;
+    lock.lock();
+
+    if (rc < 0) {
+      if (code == EINTR || code == EAGAIN) continue;
+      error = code;
+      break;
+    }
+
+    if (fds[0].revents) {
+      while (::read(wakeup[0], chunk.data(), chunk.size()) > 0);
+    }
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+      if (fds[1 + 2 * i].revents && workers[i].alive) {
+        send(workers[i]);
+      }
+      if (fds[2 + 2 * i].revents && workers[i].alive) {
+        receive(workers[i], i, chunk);
+      }
+    }
+  }
+
+  ready.notify_all();
+}
+
+
+/* --- process_pool ------------------------------------------------- */
+
+process_pool::process_pool (const char * _command, char *const _arguments[], char *const _environment[],
+                            const char * _workdir, process_handle_t::termination_mode_type _termination_mode,
+                            const spawn_options & _options, size_t _size, protocol_type _protocol,
+                            size_t _inflight)
+  : impl(nullptr)
+{
+  if (!_size || !_inflight) {
+    throw subprocess_exception(EINVAL, "a pool needs at least one worker and one request in flight");
+  }
+  if (!_options.piped(PIPE_STDIN) || !_options.piped(PIPE_STDOUT)) {
+    throw subprocess_exception(EINVAL, "workers must read requests from and answer to the pool");
+  }
+  if (_options.piped(PIPE_STDERR)) {
+    throw subprocess_exception(EINVAL, "standard error of workers must be redirected");
+  }
+
+  std::unique_ptr<state> pool(new state());
+
+  pool->command = _command;
+  pool->workdir = _workdir ? _workdir : "";
+  // skip argv[0], the command is put there on each spawn
+  for (char *const * argument = _arguments + (*_arguments ? 1 : 0); *argument; ++argument) {
+    pool->arguments.push_back(*argument);
+  }
+  for (char *const * variable = _environment; variable && *variable; ++variable) {
+    pool->environment.push_back(*variable);
+  }
+  pool->termination_mode = _termination_mode;
+
+  // the scheduler reads output itself
+  pool->options = _options;
+  pool->options.background_reader = false;
+  pool->options.keep_fds = nullptr;
+  pool->options.keep_fds_count = 0;
+  for (int i = 0; i < 3; ++i) {
+    pool->options.tee_path[i] = nullptr;
+    pool->options.redirect_path[i] = nullptr;
+  }
+  if (_options.redirect[PIPE_STDERR] == spawn_options::REDIRECT_FILE) {
+    pool->stderr_path = _options.redirect_path[PIPE_STDERR];
+  }
+
+  pool->protocol = _protocol;
+  pool->inflight = _inflight;
+
+  pool->workers.resize(_size);
+  for (state::worker & w : pool->workers) {
+    pool->spawn(w);
+  }
+
+  if (pipe(pool->wakeup) < 0) {
+    throw subprocess_exception(errno, "could not create a pipe");
+  }
+  for (int fd : pool->wakeup) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+
+  pool->start = std::chrono::steady_clock::now();
+  pool->thread = std::thread(&state::run, pool.get());
+  impl = pool.release();
+}
+
+
+process_pool::~process_pool ()
+{
+  if (!impl) return;
+
+  {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    impl->stopped = true;
+  }
+  impl->wake();
+  impl->thread.join();
+
+  // end of input asks workers to exit; those which do not are killed
+  // when their handles are destroyed
+  for (state::worker & w : impl->workers) {
+    if (!w.handle || w.handle->pipe_stdin == HANDLE_CLOSED) continue;
+    ::close(w.handle->pipe_stdin);
+    w.handle->pipe_stdin = HANDLE_CLOSED;
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(shutdown_grace);
+  for (state::worker & w : impl->workers) {
+    if (!w.handle) continue;
+    try {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+      w.handle->wait(std::max(0, static_cast<int>(left)));
+    }
+    catch (...) {
+    }
+  }
+
+  delete impl;
+}
+
+
+void process_pool::submit (const input_buffer * _requests, size_t _count, uint64_t * _ids)
+{
+  vector<vector<char> > encoded(_count);
+  for (size_t i = 0; i < _count; ++i) {
+    const char * data = _requests[i].data;
+    size_t length = _requests[i].length;
+
+    if (impl->protocol == PROTOCOL_LINE) {
+      if (memchr(data, '\n', length)) {
+        throw subprocess_exception(EINVAL, "a request of the line protocol cannot contain a new line");
+      }
+      encoded[i].reserve(length + 1);
+      encoded[i].assign(data, data + length);
+      encoded[i].push_back('\n');
+    }
+    else {
+      if (length > UINT32_MAX) {
+        throw subprocess_exception(EINVAL, "a request is too long for a frame");
+      }
+      encoded[i].reserve(length + 4);
+      encoded[i].push_back(static_cast<char>((length >> 24) & 0xff));
+      encoded[i].push_back(static_cast<char>((length >> 16) & 0xff));
+      encoded[i].push_back(static_cast<char>((length >> 8) & 0xff));
+      encoded[i].push_back(static_cast<char>(length & 0xff));
+      encoded[i].insert(encoded[i].end(), data, data + length);
+    }
+  }
+
+  restart();
+
+  {
+    std::lock_guard<std::mutex> lock(impl->mutex);
+    for (size_t i = 0; i < _count; ++i) {
+      _ids[i] = ++impl->submitted;
+      impl->queue.emplace_back(_ids[i], std::move(encoded[i]));
+    }
+  }
+  impl->wake();
+}
+
+
+size_t process_pool::collect (vector<result> & _results, size_t _max, int _timeout)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(0, _timeout));
+
+  while (true) {
+    restart();
+
+    std::unique_lock<std::mutex> lock(impl->mutex);
+    if (impl->error) {
+      throw subprocess_exception(impl->error, "pool scheduler failed");
+    }
+
+    auto done = [this] {
+      return !impl->results.empty() || impl->error || impl->any_dead() ||
+             (impl->queue.empty() && !impl->running());
+    };
+
+    if (_timeout < 0) {
+      impl->ready.wait(lock, done);
+    }
+    else if (_timeout > 0) {
+      impl->ready.wait_until(lock, deadline, done);
+    }
+
+    // a dead worker is replaced and waiting goes on
+    bool expired = _timeout >= 0 && std::chrono::steady_clock::now() >= deadline;
+    if (impl->results.empty() && !impl->error && impl->any_dead() && !expired) {
+      continue;
+    }
+
+    size_t count = std::min(_max, impl->results.size());
+    for (size_t i = 0; i < count; ++i) {
+      _results.push_back(std::move(impl->results.front()));
+      impl->results.pop_front();
+    }
+    return count;
+  }
+}
+
+
+process_pool::statistics process_pool::stats ()
+{
+  std::lock_guard<std::mutex> lock(impl->mutex);
+
+  statistics ans;
+  ans.submitted = impl->submitted;
+  ans.completed = impl->completed;
+  ans.failed    = impl->failed;
+  ans.restarts  = impl->restarts;
+  ans.queued    = impl->queue.size();
+  ans.running   = impl->running();
+  ans.ready     = impl->results.size();
+  ans.idle = ans.alive = 0;
+  for (const state::worker & w : impl->workers) {
+    if (!w.alive) continue;
+    ++ans.alive;
+    if (w.tasks.empty()) ++ans.idle;
+  }
+  ans.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - impl->start).count();
+
+  return ans;
+}
+
+
+size_t process_pool::restart ()
+{
+  size_t started = 0;
+
+  for (state::worker & w : impl->workers) {
+    {
+      std::lock_guard<std::mutex> lock(impl->mutex);
+      if (w.alive) continue;
+    }
+
+    // the scheduler does not touch a dead worker; the old child is
+    // gone together with its handle, once the new one has been set
+    state::worker fresh;
+    impl->spawn(fresh);
+    {
+      std::lock_guard<std::mutex> lock(impl->mutex);
+      w.handle.swap(fresh.handle);
+      w.alive = true;
+      ++impl->restarts;
+    }
+    ++started;
+  }
+
+  if (started) {
+    impl->wake();
+  }
+  return started;
+}
+
+
+} /* namespace subprocess */
@@ -8,9 +8,11 @@
 #include "rapi.h"
 #include "subprocess.h"
 
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include <functional>
+#include <map>
 
 #include <signal.h>
 
@@ -23,6 +25,10 @@
 #include <R.h>
 #include <Rdefines.h>
 
+#ifndef SUBPROCESS_WINDOWS
+#include <R_ext/eventloop.h>
+#endif
+
 
 using namespace subprocess;
 
@@ -32,15 +38,26 @@ using namespace subprocess;
 static int is_nonempty_string(SEXP _obj);
 static int is_single_string_or_NULL(SEXP _obj);
 static int is_single_integer(SEXP _obj);
+static int is_single_logical(SEXP _obj);
 
 static void C_child_process_finalizer(SEXP ptr);
 
+static void forget_callbacks (process_handle_t * _handle);
+
 static char ** to_C_array (SEXP _array);
 
 static void free_C_array (char ** _array);
 
+static char ** borrow_C_array (SEXP _array);
+
 static SEXP allocate_single_bool (bool _value);
 
+static SEXP pipe_to_lines (pipe_writer & _pipe, bool _incomplete);
+
+static bool lines_fit (const pipe_writer & _pipe);
+
+static SEXP pipe_to_RAWSXP (const pipe_writer & _pipe);
+
 static SEXP allocate_TRUE () { return allocate_single_bool(true); }
 //static SEXP allocate_FALSE () { return allocate_single_bool(false); }
 
@@ -78,6 +95,59 @@ try_run (F _f, Args ... _args)
 }
 
 
+/*
+ * Like try_run() but returns to the caller: the error message is
+ * stored in `_buffer` and `false` is returned.
+ */
+template<typename F>
+inline bool try_catch (char * _buffer, size_t _length, F _f)
+{
+  try {
+    _f();
+    return true;
+  }
+  catch (subprocess_exception & e) {
+    e.store(_buffer, _length - 1);
+  }
+  return false;
+}
+
+
+/*
+ * Native objects which must survive an error raised while their
+ * contents are converted to R are owned by an external pointer: the
+ * garbage collector deletes them if Rf_error() jumps over the caller.
+ * release_native() frees them as soon as they are no longer needed.
+ */
+template<typename T>
+static void native_finalizer (SEXP _ptr)
+{
+  delete static_cast<T*>(R_ExternalPtrAddr(_ptr));
+  R_ClearExternalPtr(_ptr);
+}
+
+template<typename T>
+static T * owned_by_R (SEXP * _owner)
+{
+  /* the pointer exists before the object so that it cannot leak */
+  SEXP ptr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+  R_RegisterCFinalizerEx(ptr, native_finalizer<T>, TRUE);
+  T * object = new T();
+  R_SetExternalPtrAddr(ptr, object);
+  *_owner = ptr;
+
+  /* ptr; the caller protects it */
+  UNPROTECT(1);
+  return object;
+}
+
+template<typename T>
+static void release_native (SEXP _owner)
+{
+  native_finalizer<T>(_owner);
+}
+
+
 /* --- public R API ------------------------------------------------- */
 
 static process_handle_t * extract_process_handle (SEXP _handle)
@@ -96,7 +166,223 @@ static process_handle_t * extract_process_handle (SEXP _handle)
 }
 
 
-SEXP C_process_spawn (SEXP _command, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode)
+/*
+ * Find an element of a named list; R_NilValue if not present.
+ */
+static SEXP list_element (SEXP _list, const char * _name)
+{
+  SEXP names = getAttrib(_list, R_NamesSymbol);
+  for (int i = 0; i < LENGTH(_list); ++i) {
+    if (!strcmp(CHAR(STRING_ELT(names, i)), _name)) {
+      return VECTOR_ELT(_list, i);
+    }
+  }
+  return R_NilValue;
+}
+
+
+/*
+ * Translate spawn options from a named R list. Elements which are
+ * not present keep their default values.
+ */
+static spawn_options extract_spawn_options (SEXP _options)
+{
+  spawn_options options;
+  if (_options == R_NilValue) {
+    return options;
+  }
+  if (!isNewList(_options) || (LENGTH(_options) && getAttrib(_options, R_NamesSymbol) == R_NilValue)) {
+    Rf_error("`options` must be a named list");
+  }
+
+  SEXP element = list_element(_options, "background_reader");
+  if (element != R_NilValue) {
+    if (!is_single_logical(element)) {
+      Rf_error("`background_reader` must be a single logical value");
+    }
+    options.background_reader = LOGICAL_DATA(element)[0] == TRUE;
+  }
+
+  element = list_element(_options, "buffer_limit");
+  if (element != R_NilValue) {
+    if (!isReal(element) || LENGTH(element) != 1 || !(NUMERIC_DATA(element)[0] >= 1)) {
+      Rf_error("`buffer_limit` must be a single positive number");
+    }
+    options.buffer_limit = (size_t)NUMERIC_DATA(element)[0];
+  }
+
+  element = list_element(_options, "buffer_overflow");
+  if (element != R_NilValue) {
+    if (!is_nonempty_string(element)) {
+      Rf_error("`buffer_overflow` must be a single character value");
+    }
+    const char * policy = translateChar(STRING_ELT(element, 0));
+    if (!strcmp(policy, "block")) {
+      options.overflow_policy = spawn_options::OVERFLOW_BLOCK;
+    }
+    else if (!strcmp(policy, "drop")) {
+      options.overflow_policy = spawn_options::OVERFLOW_DROP;
+    }
+    else {
+      Rf_error("unknown value for `buffer_overflow`");
+    }
+  }
+
+  element = list_element(_options, "engine");
+  if (element != R_NilValue) {
+    if (!is_nonempty_string(element)) {
+      Rf_error("`engine` must be a single character value");
+    }
+    const char * engine = translateChar(STRING_ELT(element, 0));
+    if (!strcmp(engine, "auto")) {
+      options.engine = spawn_options::ENGINE_AUTO;
+    }
+    else if (!strcmp(engine, "fork")) {
+      options.engine = spawn_options::ENGINE_FORK;
+    }
+    else if (!strcmp(engine, "posix_spawn")) {
+      options.engine = spawn_options::ENGINE_POSIX_SPAWN;
+    }
+    else if (!strcmp(engine, "fork_server")) {
+      options.engine = spawn_options::ENGINE_FORK_SERVER;
+    }
+    else {
+      Rf_error("unknown value for `engine`");
+    }
+  }
+
+  /* points into R memory which is valid until .Call() returns */
+  element = list_element(_options, "keep_fds");
+  if (element != R_NilValue) {
+    if (!isInteger(element)) {
+      Rf_error("`keep_fds` must be an integer vector");
+    }
+    for (int i=0; i<LENGTH(element); ++i) {
+      if (INTEGER_DATA(element)[i] == NA_INTEGER || INTEGER_DATA(element)[i] < 3) {
+        Rf_error("`keep_fds` must be descriptors other than standard streams");
+      }
+    }
+    options.keep_fds       = INTEGER_DATA(element);
+    options.keep_fds_count = LENGTH(element);
+  }
+
+  /* stdin, stdout, stderr; paths point into R memory as well */
+  element = list_element(_options, "redirect");
+  if (element != R_NilValue) {
+    SEXP paths  = list_element(_options, "redirect_path");
+    SEXP append = list_element(_options, "redirect_append");
+    if (!isString(element) || LENGTH(element) != 3 || !isString(paths) || LENGTH(paths) != 3 ||
+        !isLogical(append) || LENGTH(append) != 3)
+    {
+      Rf_error("`redirect`, `redirect_path` and `redirect_append` must have three elements");
+    }
+
+    for (int i = 0; i < 3; ++i) {
+      const char * mode = translateChar(STRING_ELT(element, i));
+      if (!strcmp(mode, "pipe")) {
+        options.redirect[i] = spawn_options::REDIRECT_PIPE;
+      }
+      else if (!strcmp(mode, "null")) {
+        options.redirect[i] = spawn_options::REDIRECT_NULL;
+      }
+      else if (!strcmp(mode, "inherit")) {
+        options.redirect[i] = spawn_options::REDIRECT_INHERIT;
+      }
+      else if (!strcmp(mode, "stdout") && i == PIPE_STDERR) {
+        options.redirect[i] = spawn_options::REDIRECT_STDOUT;
+      }
+      else if (!strcmp(mode, "file") && STRING_ELT(paths, i) != NA_STRING) {
+        options.redirect[i] = spawn_options::REDIRECT_FILE;
+        options.redirect_path[i] = translateChar(STRING_ELT(paths, i));
+        options.redirect_append[i] = LOGICAL_DATA(append)[i] == TRUE;
+      }
+      else {
+        Rf_error("unknown value for `redirect`");
+      }
+    }
+  }
+
+  /* log files for stdout and stderr, NA if not requested */
+  element = list_element(_options, "tee_path");
+  if (element != R_NilValue) {
+    SEXP append = list_element(_options, "tee_append");
+    if (!isString(element) || LENGTH(element) != 3 || !isLogical(append) || LENGTH(append) != 3) {
+      Rf_error("`tee_path` and `tee_append` must have three elements");
+    }
+    if (STRING_ELT(element, PIPE_STDIN) != NA_STRING) {
+      Rf_error("standard input cannot be copied to a log file");
+    }
+
+    for (int i = PIPE_STDOUT; i <= PIPE_STDERR; ++i) {
+      if (STRING_ELT(element, i) == NA_STRING) continue;
+      options.tee_path[i] = translateChar(STRING_ELT(element, i));
+      options.tee_append[i] = LOGICAL_DATA(append)[i] == TRUE;
+    }
+  }
+
+  /* requested pipe capacity, 0 for the system default */
+  element = list_element(_options, "pipe_size");
+  if (element != R_NilValue) {
+    if (!isReal(element) || LENGTH(element) != 3) {
+      Rf_error("`pipe_size` must have three elements");
+    }
+    for (int i = 0; i < 3; ++i) {
+      double size = NUMERIC_DATA(element)[i];
+      if (!(size >= 0 && size <= INT_MAX)) {
+        Rf_error("`pipe_size` must be a non-negative number of bytes");
+      }
+      options.pipe_size[i] = (size_t)size;
+    }
+  }
+
+  return options;
+}
+
+
+/* NULL or an empty string means "inherit from parent" */
+static const char * extract_workdir (SEXP _workdir)
+{
+  if (_workdir == R_NilValue) return NULL;
+  const char * workdir = translateChar(STRING_ELT(_workdir, 0));
+  return strlen(workdir) ? workdir : NULL;
+}
+
+
+static process_handle_t::termination_mode_type extract_termination_mode (SEXP _termination_mode)
+{
+  const char * termination_mode_str = translateChar(STRING_ELT(_termination_mode, 0));
+  if (!strncmp(termination_mode_str, "child_only", 10)) {
+    return process_handle_t::TERMINATION_CHILD_ONLY;
+  }
+  if (strncmp(termination_mode_str, "group", 5)) {
+    Rf_error("unknown value for `termination_mode`");
+  }
+  return process_handle_t::TERMINATION_GROUP;
+}
+
+
+/*
+ * Wrap a spawned process in an external pointer and return the child
+ * process PID with that pointer attached as an attribute.
+ */
+static SEXP wrap_process_handle (process_handle_t * _handle)
+{
+  SEXP ptr;
+  PROTECT(ptr = R_MakeExternalPtr(_handle, install("process_handle"), R_NilValue));
+  R_RegisterCFinalizerEx(ptr, C_child_process_finalizer, TRUE);
+
+  SEXP ans;
+  ans = PROTECT(allocVector(INTSXP, 1));
+  INTEGER(ans)[0] = _handle->child_id;
+  setAttrib(ans, install("handle_ptr"), ptr);
+
+  /* ptr, ans */
+  UNPROTECT(2);
+  return ans;
+}
+
+
+SEXP C_process_spawn (SEXP _command, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options)
 {
   /* basic argument sanity checks */
   if (!is_nonempty_string(_command)) {
@@ -115,6 +401,12 @@ SEXP C_process_spawn (SEXP _command, SEXP _arguments, SEXP _environment, SEXP _w
     Rf_error("`termination_mode` must be a non-emptry string");
   }
 
+  /* verify options before any memory is allocated */
+  spawn_options options = extract_spawn_options(_options);
+  const char * workdir = extract_workdir(_workdir);
+  process_handle_t::termination_mode_type termination_mode =
+    extract_termination_mode(_termination_mode);
+
   /* translate into C */
   const char * command = translateChar(STRING_ELT(_command, 0));
 
@@ -128,58 +420,331 @@ SEXP C_process_spawn (SEXP _command, SEXP _arguments, SEXP _environment, SEXP _w
     environment = NULL;
   }
 
-  /* if workdir is NULL or an empty string, inherit from parent */
-  const char * workdir = NULL;
-  if (_workdir != R_NilValue) {
-	  workdir = translateChar(STRING_ELT(_workdir, 0));
-    if (strlen(workdir) == 0) {
-      workdir = NULL;
-    }
-  }
-
-  /* see if termination mode is set properly */
-  const char * termination_mode_str = translateChar(STRING_ELT(_termination_mode, 0));
-  process_handle_t::termination_mode_type termination_mode = process_handle_t::TERMINATION_GROUP;
-  if (!strncmp(termination_mode_str, "child_only", 10)) {
-    termination_mode = process_handle_t::TERMINATION_CHILD_ONLY;
-  }
-  else if (strncmp(termination_mode_str, "group", 5)) {
-    Rf_error("unknown value for `termination_mode`");
-  }
-
   /* Calloc() handles memory allocation errors internally */
   process_handle_t * handle = (process_handle_t*)Calloc(1, process_handle_t);
   handle = new (handle) process_handle_t();
 
   /* spawn the process */
-  try_run(&process_handle_t::spawn, handle, command, arguments, environment, workdir, termination_mode);
-
-  /* return an external pointer handle */
-  SEXP ptr;
-  PROTECT(ptr = R_MakeExternalPtr(handle, install("process_handle"), R_NilValue));
-  R_RegisterCFinalizerEx(ptr, C_child_process_finalizer, TRUE);
+  try_run(&process_handle_t::spawn, handle, command, arguments, environment, workdir, termination_mode, options);
 
   /* return the child process PID */
-  SEXP ans;
-  ans = PROTECT(allocVector(INTSXP, 1));
-  INTEGER(ans)[0] = handle->child_id;
-  setAttrib(ans, install("handle_ptr"), ptr);
+  SEXP ans = wrap_process_handle(handle);
 
   /* free temporary memory */
   free_C_array(arguments);
   free_C_array(environment);
 
-  /* ptr, ans */
+  return ans;
+}
+
+
+SEXP C_process_spawn_many (SEXP _commands, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options)
+{
+  /* basic argument sanity checks */
+  if (!isString(_commands)) {
+    Rf_error("invalid value for `commands`");
+  }
+  if (!isNewList(_arguments) || LENGTH(_arguments) != LENGTH(_commands)) {
+    Rf_error("`arguments` must be a list of the same length as `commands`");
+  }
+  for (int i=0; i<LENGTH(_arguments); ++i) {
+    if (!isString(VECTOR_ELT(_arguments, i))) {
+      Rf_error("invalid value for `arguments`");
+    }
+  }
+  if (!isString(_environment)) {
+    Rf_error("invalid value for `environment`");
+  }
+  if (!is_single_string_or_NULL(_workdir)) {
+    Rf_error("`workdir` must be a non-empty string");
+  }
+  if (!is_nonempty_string(_termination_mode)) {
+    Rf_error("`termination_mode` must be a non-emptry string");
+  }
+
+  spawn_options options = extract_spawn_options(_options);
+  const char * workdir = extract_workdir(_workdir);
+  process_handle_t::termination_mode_type termination_mode =
+    extract_termination_mode(_termination_mode);
+
+  int count = LENGTH(_commands);
+  SEXP ans    = PROTECT(allocVector(VECSXP, count));
+  SEXP errors = PROTECT(allocVector(STRSXP, count));
+
+  /* environment is shared by all children so it is converted once */
+  const void * vmax = vmaxget();
+  char ** environment = borrow_C_array(_environment);
+  if (!*environment) {
+    environment = NULL;
+  }
+
+  char error[BUFFER_SIZE];
+  for (int i=0; i<count; ++i) {
+    const void * vmax_child = vmaxget();
+    const char * command = translateChar(STRING_ELT(_commands, i));
+    char ** arguments = borrow_C_array(VECTOR_ELT(_arguments, i));
+
+    process_handle_t * handle = (process_handle_t*)Calloc(1, process_handle_t);
+    handle = new (handle) process_handle_t();
+
+    /* a failed child must not abort the remaining ones */
+    bool spawned = try_catch(error, sizeof(error), [&] {
+      handle->spawn(command, arguments, environment, workdir, termination_mode, options);
+    });
+    vmaxset(vmax_child);
+
+    if (spawned) {
+      SET_VECTOR_ELT(ans, i, wrap_process_handle(handle));
+      SET_STRING_ELT(errors, i, NA_STRING);
+    }
+    else {
+      handle->~process_handle_t();
+      Free(handle);
+      SET_STRING_ELT(errors, i, mkChar(error));
+    }
+  }
+  vmaxset(vmax);
+
+  setAttrib(ans, install("errors"), errors);
+
+  /* ans, errors */
   UNPROTECT(2);
   return ans;
 }
 
 
+SEXP C_process_spawn_pipeline (SEXP _commands, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options)
+{
+  /* basic argument sanity checks */
+  if (!isString(_commands) || !LENGTH(_commands)) {
+    Rf_error("invalid value for `commands`");
+  }
+  if (!isNewList(_arguments) || LENGTH(_arguments) != LENGTH(_commands)) {
+    Rf_error("`arguments` must be a list of the same length as `commands`");
+  }
+  for (int i=0; i<LENGTH(_arguments); ++i) {
+    if (!isString(VECTOR_ELT(_arguments, i))) {
+      Rf_error("invalid value for `arguments`");
+    }
+  }
+  if (!isString(_environment)) {
+    Rf_error("invalid value for `environment`");
+  }
+  if (!is_single_string_or_NULL(_workdir)) {
+    Rf_error("`workdir` must be a non-empty string");
+  }
+  if (!is_nonempty_string(_termination_mode)) {
+    Rf_error("`termination_mode` must be a non-emptry string");
+  }
+
+  spawn_options options = extract_spawn_options(_options);
+  const char * workdir = extract_workdir(_workdir);
+  process_handle_t::termination_mode_type termination_mode =
+    extract_termination_mode(_termination_mode);
+
+  int count = LENGTH(_commands);
+
+  /* strings are borrowed from R until all children are running */
+  const void * vmax = vmaxget();
+  char ** environment = borrow_C_array(_environment);
+  if (!*environment) {
+    environment = NULL;
+  }
+
+  const char ** commands = (const char **)R_alloc(count, sizeof(char *));
+  char *** arguments = (char ***)R_alloc(count, sizeof(char **));
+  for (int i=0; i<count; ++i) {
+    commands[i] = translateChar(STRING_ELT(_commands, i));
+    arguments[i] = borrow_C_array(VECTOR_ELT(_arguments, i));
+  }
+
+  process_handle_t ** handles = (process_handle_t **)R_alloc(count, sizeof(process_handle_t *));
+  for (int i=0; i<count; ++i) {
+    handles[i] = (process_handle_t*)Calloc(1, process_handle_t);
+    handles[i] = new (handles[i]) process_handle_t();
+  }
+
+  /* children are connected to each other so they succeed or fail together */
+  char message[BUFFER_SIZE];
+  bool spawned = try_catch(message, sizeof(message), [&] {
+    spawn_pipeline(handles, count, commands, arguments, environment, workdir,
+                   termination_mode, options);
+  });
+
+  if (!spawned) {
+    for (int i=0; i<count; ++i) {
+      handles[i]->~process_handle_t();
+      Free(handles[i]);
+    }
+    vmaxset(vmax);
+    Rf_error("%s", message);
+  }
+
+  SEXP ans = PROTECT(allocVector(VECSXP, count));
+  for (int i=0; i<count; ++i) {
+    SET_VECTOR_ELT(ans, i, wrap_process_handle(handles[i]));
+  }
+  vmaxset(vmax);
+
+  /* ans */
+  UNPROTECT(1);
+  return ans;
+}
+
+
+/*
+ * Returns columns of the result: output, exit status or signal,
+ * whether the job timed out, the error if it could not be started,
+ * and times of start and end.
+ */
+SEXP C_process_run_parallel (SEXP _commands, SEXP _arguments, SEXP _environment, SEXP _workdir,
+                             SEXP _termination_mode, SEXP _options, SEXP _max_jobs, SEXP _timeout,
+                             SEXP _binary)
+{
+  /* basic argument sanity checks */
+  if (!isString(_commands)) {
+    Rf_error("invalid value for `commands`");
+  }
+  if (!isNewList(_arguments) || LENGTH(_arguments) != LENGTH(_commands)) {
+    Rf_error("`arguments` must be a list of the same length as `commands`");
+  }
+  for (int i=0; i<LENGTH(_arguments); ++i) {
+    if (!isString(VECTOR_ELT(_arguments, i))) {
+      Rf_error("invalid value for `arguments`");
+    }
+  }
+  if (!isString(_environment)) {
+    Rf_error("invalid value for `environment`");
+  }
+  if (!is_single_string_or_NULL(_workdir)) {
+    Rf_error("`workdir` must be a non-empty string");
+  }
+  if (!is_nonempty_string(_termination_mode)) {
+    Rf_error("`termination_mode` must be a non-emptry string");
+  }
+  if (!is_single_integer(_max_jobs) || INTEGER_DATA(_max_jobs)[0] < 1) {
+    Rf_error("`max_jobs` must be a single positive integer value");
+  }
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+  if (!is_single_logical(_binary)) {
+    Rf_error("`binary` must be a single logical value");
+  }
+
+  spawn_options options = extract_spawn_options(_options);
+  const char * workdir = extract_workdir(_workdir);
+  process_handle_t::termination_mode_type termination_mode =
+    extract_termination_mode(_termination_mode);
+
+  int count    = LENGTH(_commands);
+  int max_jobs = INTEGER_DATA(_max_jobs)[0];
+  int timeout  = INTEGER_DATA(_timeout)[0];
+  bool binary  = LOGICAL_DATA(_binary)[0] == TRUE;
+
+  /* strings are borrowed from R until all jobs have completed */
+  const void * vmax = vmaxget();
+  char ** environment = borrow_C_array(_environment);
+  if (!*environment) {
+    environment = NULL;
+  }
+
+  const char ** commands = (const char **)R_alloc(count, sizeof(char *));
+  char *** arguments = (char ***)R_alloc(count, sizeof(char **));
+  for (int i=0; i<count; ++i) {
+    commands[i] = translateChar(STRING_ELT(_commands, i));
+    arguments[i] = borrow_C_array(VECTOR_ELT(_arguments, i));
+  }
+
+  /* results are freed by the garbage collector should Rf_error() jump */
+  SEXP owner;
+  vector<job_result> & results = *owned_by_R<vector<job_result>>(&owner);
+  PROTECT(owner);
+
+  char message[BUFFER_SIZE];
+  bool success = try_catch(message, sizeof(message), [&] {
+    results.resize(count);
+    run_parallel(count, commands, arguments, environment, workdir, termination_mode,
+                 options, max_jobs, timeout, results.data());
+  });
+
+  vmaxset(vmax);
+  if (!success) {
+    release_native<vector<job_result>>(owner);
+    Rf_error("%s", message);
+  }
+
+  /* output which cannot be split into R strings fails only its job */
+  if (!binary) {
+    for (job_result & result : results) {
+      if (lines_fit(result.stdout_) && lines_fit(result.stderr_)) continue;
+      if (result.error.empty()) {
+        result.error = "output line too long to fit in a single string, use type = \"raw\"";
+      }
+      result.stdout_ = pipe_writer();
+      result.stderr_ = pipe_writer();
+    }
+  }
+
+  const char * names[] = { "stdout", "stderr", "status", "signal", "timed_out", "error",
+                           "start", "end" };
+  const int ncolumns = sizeof(names)/sizeof(names[0]);
+
+  SEXP ans, nms;
+  PROTECT(ans = allocVector(VECSXP, ncolumns));
+  PROTECT(nms = allocVector(STRSXP, ncolumns));
+  for (int i=0; i<ncolumns; ++i) {
+    SET_STRING_ELT(nms, i, mkChar(names[i]));
+  }
+  setAttrib(ans, R_NamesSymbol, nms);
+
+  SET_VECTOR_ELT(ans, 0, allocVector(VECSXP, count));
+  SET_VECTOR_ELT(ans, 1, allocVector(VECSXP, count));
+  SET_VECTOR_ELT(ans, 2, allocVector(INTSXP, count));
+  SET_VECTOR_ELT(ans, 3, allocVector(INTSXP, count));
+  SET_VECTOR_ELT(ans, 4, allocVector(LGLSXP, count));
+  SET_VECTOR_ELT(ans, 5, allocVector(STRSXP, count));
+  SET_VECTOR_ELT(ans, 6, allocVector(REALSXP, count));
+  SET_VECTOR_ELT(ans, 7, allocVector(REALSXP, count));
+
+  for (int i=0; i<count; ++i) {
+    job_result & result = results[i];
+
+    SET_VECTOR_ELT(VECTOR_ELT(ans, 0), i, binary ? pipe_to_RAWSXP(result.stdout_) :
+                                                   pipe_to_lines(result.stdout_, true));
+    SET_VECTOR_ELT(VECTOR_ELT(ans, 1), i, binary ? pipe_to_RAWSXP(result.stderr_) :
+                                                   pipe_to_lines(result.stderr_, true));
+
+    bool exited = result.state == process_handle_t::EXITED,
+         signaled = result.state == process_handle_t::TERMINATED;
+    INTEGER_DATA(VECTOR_ELT(ans, 2))[i] = exited ? result.return_code : NA_INTEGER;
+    INTEGER_DATA(VECTOR_ELT(ans, 3))[i] = signaled ? result.return_code : NA_INTEGER;
+    LOGICAL_DATA(VECTOR_ELT(ans, 4))[i] = result.timed_out;
+    SET_STRING_ELT(VECTOR_ELT(ans, 5), i, result.error.empty() ? NA_STRING :
+                                          mkChar(result.error.c_str()));
+    REAL(VECTOR_ELT(ans, 6))[i] = result.start;
+    REAL(VECTOR_ELT(ans, 7))[i] = result.end;
+
+    /* output has been copied, buffers can go */
+    result.stdout_ = pipe_writer();
+    result.stderr_ = pipe_writer();
+  }
+  release_native<vector<job_result>>(owner);
+
+  /* owner, ans, nms */
+  UNPROTECT(3);
+  return ans;
+}
+
+
 static void C_child_process_finalizer(SEXP ptr)
 {
   process_handle_t * handle = (process_handle_t*)R_ExternalPtrAddr(ptr);
   if (!handle) return;
 
+  // pipes must not be watched once they are closed
+  forget_callbacks(handle);
+
   // it might be necessary to terminate the process first
   auto try_terminate = [&handle] {
     try {
@@ -188,65 +753,913 @@ static void C_child_process_finalizer(SEXP ptr)
       handle->wait(TIMEOUT_IMMEDIATE);
       handle->terminate();
     }
-    catch (subprocess_exception) {
-      handle->~process_handle_t();
-      Free(handle);
-      throw;
+    catch (subprocess_exception) {
+      handle->~process_handle_t();
+      Free(handle);
+      throw;
+    }
+  };
+
+  // however termination goes, close pipe handles and free memory
+  try_run(try_terminate);
+  handle->~process_handle_t();
+  Free(handle);
+
+  R_ClearExternalPtr(ptr); /* not really needed */
+}
+
+
+
+/*
+ * Common part of C_process_read() and C_process_read_raw(): verify
+ * arguments and read from the child process.
+ */
+static pipe_type extract_pipe (SEXP _pipe)
+{
+  if (!is_nonempty_string(_pipe)) {
+    Rf_error("`pipe` must be a single character value");
+  }
+
+  const char * pipe = translateChar(STRING_ELT(_pipe, 0));
+
+  if (!strncmp(pipe, "stdout", 6))
+    return PIPE_STDOUT;
+  if (!strncmp(pipe, "stderr", 6))
+    return PIPE_STDERR;
+  if (!strncmp(pipe, "both", 4))
+    return PIPE_BOTH;
+
+  Rf_error("unrecognized `pipe` value");
+  return PIPE_BOTH; // never reached
+}
+
+
+/* a log file which could not be written is reported once */
+static void report_tee_errors (process_handle_t * _handle)
+{
+  output_tee * tees[2] = { &_handle->stdout_tee, &_handle->stderr_tee };
+  const char * names[2] = { "stdout", "stderr" };
+
+  for (int i = 0; i < 2; ++i) {
+    int code = tees[i]->error;
+    if (!code || tees[i]->reported) continue;
+    tees[i]->reported = true;
+
+    char message[BUFFER_SIZE] = { 0 };
+    subprocess_exception(code, string("could not copy ") + names[i] + " to log file")
+      .store(message, sizeof(message) - 1);
+    Rf_warning("%s", message);
+  }
+}
+
+
+static pipe_type read_from_child (process_handle_t * _handle, SEXP _pipe,
+                                  SEXP _timeout, SEXP _flush, bool _binary)
+{
+  pipe_type which_pipe = extract_pipe(_pipe);
+
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+  if (!is_single_logical(_flush)) {
+    Rf_error("`flush` must be a single logical value");
+  }
+
+  /* extract timeout */
+  int timeout = INTEGER_DATA(_timeout)[0];
+  bool flush = LOGICAL_DATA(_flush)[0] == TRUE;
+
+  try_run(&process_handle_t::read, _handle, which_pipe, timeout, flush, _binary);
+
+  if (_handle->dropped) {
+    double dropped = static_cast<double>(_handle->dropped);
+    _handle->dropped = 0;
+    Rf_warning("background reader buffer full, %.0f bytes of output dropped", dropped);
+  }
+  report_tee_errors(_handle);
+
+  return which_pipe;
+}
+
+
+SEXP C_process_read (SEXP _handle, SEXP _pipe, SEXP _timeout, SEXP _flush, SEXP _incomplete)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  if (!is_single_logical(_incomplete)) {
+    Rf_error("`incomplete` must be a single logical value");
+  }
+  bool incomplete = LOGICAL_DATA(_incomplete)[0] == TRUE;
+
+  pipe_type which_pipe = read_from_child(handle, _pipe, _timeout, _flush, false);
+
+  /* produce the result - a list of one or two elements; a buffer
+   * which has not been read into holds stale data; at the end of
+   * stream there is nothing to complete an incomplete line */
+  SEXP ans, nms;
+  PROTECT(ans = allocVector(VECSXP, 2));
+  PROTECT(nms = allocVector(STRSXP, 2));
+
+  SET_VECTOR_ELT(ans, 0, (which_pipe & PIPE_STDOUT) ?
+                           pipe_to_lines(handle->stdout_, incomplete || handle->stdout_.eof) :
+                           allocVector(STRSXP, 0));
+  SET_STRING_ELT(nms, 0, mkChar("stdout"));
+
+  SET_VECTOR_ELT(ans, 1, (which_pipe & PIPE_STDERR) ?
+                           pipe_to_lines(handle->stderr_, incomplete || handle->stderr_.eof) :
+                           allocVector(STRSXP, 0));
+  SET_STRING_ELT(nms, 1, mkChar("stderr"));
+
+  /* set names */
+  setAttrib(ans, R_NamesSymbol, nms);
+
+  /* ans, nms */
+  UNPROTECT(2);
+  return ans;
+}
+
+
+SEXP C_process_read_raw (SEXP _handle, SEXP _pipe, SEXP _timeout, SEXP _flush)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  pipe_type which_pipe = read_from_child(handle, _pipe, _timeout, _flush, true);
+
+  /* produce the result - a list of one or two raw vectors */
+  SEXP ans, nms;
+  PROTECT(ans = allocVector(VECSXP, 2));
+  PROTECT(nms = allocVector(STRSXP, 2));
+
+  SET_VECTOR_ELT(ans, 0, (which_pipe & PIPE_STDOUT) ?
+                           pipe_to_RAWSXP(handle->stdout_) :
+                           allocVector(RAWSXP, 0));
+  SET_STRING_ELT(nms, 0, mkChar("stdout"));
+
+  SET_VECTOR_ELT(ans, 1, (which_pipe & PIPE_STDERR) ?
+                           pipe_to_RAWSXP(handle->stderr_) :
+                           allocVector(RAWSXP, 0));
+  SET_STRING_ELT(nms, 1, mkChar("stderr"));
+
+  /* set names */
+  setAttrib(ans, R_NamesSymbol, nms);
+
+  /* ans, nms */
+  UNPROTECT(2);
+  return ans;
+}
+
+
+SEXP C_process_read_until (SEXP _handle, SEXP _pipe, SEXP _pattern, SEXP _fixed, SEXP _timeout, SEXP _binary)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+  pipe_type which_pipe = extract_pipe(_pipe);
+
+  if (which_pipe != PIPE_STDOUT && which_pipe != PIPE_STDERR) {
+    Rf_error("output can be matched in a single stream only");
+  }
+  if (!isString(_pattern) || LENGTH(_pattern) != 1 || STRING_ELT(_pattern, 0) == NA_STRING) {
+    Rf_error("`pattern` must be a single character value");
+  }
+  if (!is_single_logical(_fixed)) {
+    Rf_error("`fixed` must be a single logical value");
+  }
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+  if (!is_single_logical(_binary)) {
+    Rf_error("`binary` must be a single logical value");
+  }
+
+  const char * pattern = translateChar(STRING_ELT(_pattern, 0));
+  bool fixed  = LOGICAL_DATA(_fixed)[0] == TRUE;
+  int timeout = INTEGER_DATA(_timeout)[0];
+  bool binary = LOGICAL_DATA(_binary)[0] == TRUE;
+
+  /* the matcher owns memory so it must be gone before Rf_error() */
+  char message[BUFFER_SIZE];
+  bool found = false;
+  bool success = try_catch(message, sizeof(message), [&] {
+    output_matcher matcher(pattern, fixed);
+    found = handle->read_until(which_pipe == PIPE_STDOUT ? &matcher : nullptr,
+                               which_pipe == PIPE_STDERR ? &matcher : nullptr,
+                               timeout, binary);
+  });
+  if (!success) {
+    Rf_error("%s", message);
+  }
+
+  if (handle->dropped) {
+    double dropped = static_cast<double>(handle->dropped);
+    handle->dropped = 0;
+    Rf_warning("background reader buffer full, %.0f bytes of output dropped", dropped);
+  }
+  report_tee_errors(handle);
+
+  /* output up to and including the match, or all that has been read */
+  pipe_writer & writer = (which_pipe == PIPE_STDOUT) ? handle->stdout_ : handle->stderr_;
+  SEXP ans = PROTECT(binary ? pipe_to_RAWSXP(writer) : pipe_to_lines(writer, true));
+  setAttrib(ans, install("matched"), allocate_single_bool(found));
+
+  /* ans */
+  UNPROTECT(1);
+  return ans;
+}
+
+
+SEXP C_process_shell_run (SEXP _handle, SEXP _command, SEXP _marker, SEXP _timeout, SEXP _binary)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  if (!isString(_command) || LENGTH(_command) != 1 || STRING_ELT(_command, 0) == NA_STRING) {
+    Rf_error("`command` must be a single character value");
+  }
+  if (!isString(_marker) || LENGTH(_marker) != 1 || STRING_ELT(_marker, 0) == NA_STRING) {
+    Rf_error("`marker` must be a single character value");
+  }
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+  if (!is_single_logical(_binary)) {
+    Rf_error("`binary` must be a single logical value");
+  }
+
+  const char * command = translateChar(STRING_ELT(_command, 0));
+  const char * marker  = CHAR(STRING_ELT(_marker, 0));
+  int timeout = INTEGER_DATA(_timeout)[0];
+  bool binary = LOGICAL_DATA(_binary)[0] == TRUE;
+
+  /* the script and matchers own memory so they must be gone before Rf_error() */
+  char message[BUFFER_SIZE];
+  int status = -1;
+  bool success = try_catch(message, sizeof(message), [&] {
+    status = shell_run(*handle, command, marker, timeout, binary);
+  });
+  if (!success) {
+    Rf_error("%s", message);
+  }
+
+  if (handle->dropped) {
+    double dropped = static_cast<double>(handle->dropped);
+    handle->dropped = 0;
+    Rf_warning("background reader buffer full, %.0f bytes of output dropped", dropped);
+  }
+  report_tee_errors(handle);
+
+  /* output of the command alone or, if it did not complete, all output
+   * read so far */
+  SEXP ans, nms;
+  PROTECT(ans = allocVector(VECSXP, 3));
+  PROTECT(nms = allocVector(STRSXP, 3));
+
+  SET_VECTOR_ELT(ans, 0, binary ? pipe_to_RAWSXP(handle->stdout_) :
+                                  pipe_to_lines(handle->stdout_, true));
+  SET_STRING_ELT(nms, 0, mkChar("stdout"));
+
+  SET_VECTOR_ELT(ans, 1, binary ? pipe_to_RAWSXP(handle->stderr_) :
+                                  pipe_to_lines(handle->stderr_, true));
+  SET_STRING_ELT(nms, 1, mkChar("stderr"));
+
+  SET_VECTOR_ELT(ans, 2, allocate_single_int(status < 0 ? NA_INTEGER : status));
+  SET_STRING_ELT(nms, 2, mkChar("status"));
+
+  setAttrib(ans, R_NamesSymbol, nms);
+
+  /* ans, nms */
+  UNPROTECT(2);
+  return ans;
+}
+
+
+SEXP C_process_eof (SEXP _handle, SEXP _pipe)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+  pipe_type which_pipe = extract_pipe(_pipe);
+
+  bool eof = (!(which_pipe & PIPE_STDOUT) || handle->stdout_.eof) &&
+             (!(which_pipe & PIPE_STDERR) || handle->stderr_.eof);
+
+  return allocate_single_bool(eof);
+}
+
+
+SEXP C_process_close_input (SEXP _handle)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+  try_run(&process_handle_t::close_input, handle);
+  return allocate_TRUE();
+}
+
+
+/*
+ * Input for process_handle_t::write() and communicate(): a raw vector
+ * or elements of a character vector each followed by `_sep`. Buffers
+ * point straight into R's memory; nothing is concatenated.
+ */
+static input_buffer * extract_input (SEXP _input, SEXP _sep, size_t * _count, const char * _name)
+{
+  if (TYPEOF(_input) != STRSXP && TYPEOF(_input) != RAWSXP) {
+    Rf_error("`%s` must be a character or raw vector", _name);
+  }
+  if (TYPEOF(_sep) != STRSXP || LENGTH(_sep) != 1 || STRING_ELT(_sep, 0) == NA_STRING) {
+    Rf_error("`sep` must be a single character value");
+  }
+  if (TYPEOF(_input) == STRSXP) {
+    for (R_xlen_t i = 0; i < XLENGTH(_input); ++i) {
+      if (STRING_ELT(_input, i) == NA_STRING) {
+        Rf_error("`%s` must not contain NA", _name);
+      }
+    }
+  }
+
+  input_buffer * buffers;
+  size_t count = 0;
+
+  if (TYPEOF(_input) == RAWSXP) {
+    buffers = (input_buffer *)R_alloc(1, sizeof(input_buffer));
+    buffers[count].data = reinterpret_cast<const char *>(RAW(_input));
+    buffers[count++].length = static_cast<size_t>(XLENGTH(_input));
+  }
+  else {
+    const char * sep = translateChar(STRING_ELT(_sep, 0));
+    size_t sep_length = strlen(sep);
+    R_xlen_t length = XLENGTH(_input);
+
+    buffers = (input_buffer *)R_alloc(2 * length + 1, sizeof(input_buffer));
+    for (R_xlen_t i = 0; i < length; ++i) {
+      const char * element = translateChar(STRING_ELT(_input, i));
+      buffers[count].data = element;
+      buffers[count++].length = strlen(element);
+      if (sep_length) {
+        buffers[count].data = sep;
+        buffers[count++].length = sep_length;
+      }
+    }
+  }
+
+  *_count = count;
+  return buffers;
+}
+
+
+SEXP C_process_write (SEXP _handle, SEXP _message, SEXP _sep, SEXP _timeout)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+
+  int timeout = INTEGER_DATA(_timeout)[0];
+
+  size_t count;
+  input_buffer * buffers = extract_input(_message, _sep, &count, "message");
+
+  size_t ret = try_run(&process_handle_t::write, handle, buffers, count, timeout);
+  return ScalarReal(static_cast<double>(ret));
+}
+
+
+SEXP C_process_write_file (SEXP _handle, SEXP _path, SEXP _offset, SEXP _length, SEXP _timeout)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  if (!is_nonempty_string(_path)) {
+    Rf_error("`path` must be a single character value");
+  }
+  if (TYPEOF(_offset) != REALSXP || LENGTH(_offset) != 1 ||
+      TYPEOF(_length) != REALSXP || LENGTH(_length) != 1)
+  {
+    Rf_error("`offset` and `length` must be single numeric values");
+  }
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+
+  const char * path = translateChar(STRING_ELT(_path, 0));
+  int64_t offset = static_cast<int64_t>(REAL(_offset)[0]);
+  int64_t length = static_cast<int64_t>(REAL(_length)[0]);
+  int timeout = INTEGER_DATA(_timeout)[0];
+
+  size_t ret = try_run(&process_handle_t::write_file, handle, path, offset, length, timeout);
+  return ScalarReal(static_cast<double>(ret));
+}
+
+
+SEXP C_process_pending_input (SEXP _handle)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+  return ScalarReal(static_cast<double>(handle->stdin_.size()));
+}
+
+
+SEXP C_process_pipe_size (SEXP _handle)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  SEXP ans = PROTECT(allocVector(REALSXP, 3));
+  for (int i = 0; i < 3; ++i) {
+    size_t capacity = handle->pipe_capacity[i];
+    NUMERIC_DATA(ans)[i] = capacity ? static_cast<double>(capacity) : NA_REAL;
+  }
+
+  UNPROTECT(1);
+  return ans;
+}
+
+
+SEXP C_process_communicate (SEXP _handle, SEXP _input, SEXP _sep, SEXP _timeout, SEXP _binary)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+  if (!is_single_logical(_binary)) {
+    Rf_error("`binary` must be a single logical value");
+  }
+
+  size_t count;
+  input_buffer * input = extract_input(_input, _sep, &count, "input");
+
+  int timeout = INTEGER_DATA(_timeout)[0];
+  bool binary = LOGICAL_DATA(_binary)[0] == TRUE;
+
+  try_run(&process_handle_t::communicate, handle, input, count, timeout, binary);
+  report_tee_errors(handle);
+
+  /* all output collected; a stream which has not ended (timeout) may
+   * still hold an incomplete line, which is returned as well */
+  SEXP ans, nms;
+  PROTECT(ans = allocVector(VECSXP, 2));
+  PROTECT(nms = allocVector(STRSXP, 2));
+
+  SET_VECTOR_ELT(ans, 0, binary ? pipe_to_RAWSXP(handle->stdout_) :
+                                  pipe_to_lines(handle->stdout_, true));
+  SET_STRING_ELT(nms, 0, mkChar("stdout"));
+
+  SET_VECTOR_ELT(ans, 1, binary ? pipe_to_RAWSXP(handle->stderr_) :
+                                  pipe_to_lines(handle->stderr_, true));
+  SET_STRING_ELT(nms, 1, mkChar("stderr"));
+
+  setAttrib(ans, R_NamesSymbol, nms);
+
+  /* ans, nms */
+  UNPROTECT(2);
+  return ans;
+}
+
+
+SEXP C_process_wait (SEXP _handle, SEXP _timeout)
+{
+  /* extract timeout */
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+
+  int timeout = INTEGER_DATA(_timeout)[0];
+
+  /* extract handle */
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  /* check the process */
+  try_run(&process_handle_t::wait, handle, timeout);
+
+  return C_process_return_code(_handle);
+}
+
+
+SEXP C_process_poll (SEXP _handles, SEXP _timeout)
+{
+  if (TYPEOF(_handles) != VECSXP) {
+    Rf_error("`handles` must be a list of process handles");
+  }
+  if (!is_single_integer(_timeout)) {
+    Rf_error("`timeout` must be a single integer value");
+  }
+
+  int timeout = INTEGER_DATA(_timeout)[0];
+  size_t count = static_cast<size_t>(LENGTH(_handles));
+
+  /* freed by R when .Call() returns, even after an error */
+  process_handle_t ** handles = (process_handle_t **)R_alloc(count + 1, sizeof(process_handle_t *));
+  size_t * ready = (size_t *)R_alloc(count + 1, sizeof(size_t));
+
+  for (size_t i = 0; i < count; ++i) {
+    handles[i] = extract_process_handle(VECTOR_ELT(_handles, i));
+  }
+
+  size_t n = try_run(&poll_processes, handles, count, timeout, ready);
+
+  /* count each category first */
+  int n_data = 0, n_eof = 0, n_exited = 0;
+  for (size_t i = 0; i < n; ++i) {
+    process_handle_t * handle = handles[ready[i]];
+    n_data += handle->polling.data();
+    n_eof += handle->polling.eof();
+    n_exited += (handle->state != process_handle_t::RUNNING);
+  }
+
+  SEXP ans, nms, data, eof, exited;
+  PROTECT(ans = allocVector(VECSXP, 3));
+  PROTECT(nms = allocVector(STRSXP, 3));
+  SET_VECTOR_ELT(ans, 0, data = allocVector(INTSXP, n_data));
+  SET_VECTOR_ELT(ans, 1, eof = allocVector(INTSXP, n_eof));
+  SET_VECTOR_ELT(ans, 2, exited = allocVector(INTSXP, n_exited));
+
+  /* 1-based positions in `handles` */
+  n_data = n_eof = n_exited = 0;
+  for (size_t i = 0; i < n; ++i) {
+    process_handle_t * handle = handles[ready[i]];
+    int position = static_cast<int>(ready[i]) + 1;
+    if (handle->polling.data()) INTEGER(data)[n_data++] = position;
+    if (handle->polling.eof()) INTEGER(eof)[n_eof++] = position;
+    if (handle->state != process_handle_t::RUNNING) INTEGER(exited)[n_exited++] = position;
+  }
+
+  SET_STRING_ELT(nms, 0, mkChar("data"));
+  SET_STRING_ELT(nms, 1, mkChar("eof"));
+  SET_STRING_ELT(nms, 2, mkChar("exited"));
+  setAttrib(ans, R_NamesSymbol, nms);
+
+  /* ans, nms */
+  UNPROTECT(2);
+  return ans;
+}
+
+
+SEXP C_process_return_code (SEXP _handle)
+{
+  /* extract handle */
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  if (handle->state == process_handle_t::EXITED ||
+      handle->state == process_handle_t::TERMINATED)
+    return allocate_single_int(handle->return_code);
+  else
+    return allocate_single_int(NA_INTEGER);
+}
+
+
+SEXP C_process_state (SEXP _handle)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  /* refresh the handle */
+  try_run(&process_handle_t::wait, handle, TIMEOUT_IMMEDIATE);
+
+  /* answer */
+  SEXP ans;
+  PROTECT(ans = allocVector(STRSXP, 1));
+
+  if (handle->state == process_handle_t::EXITED) {
+    SET_STRING_ELT(ans, 0, mkChar("exited"));
+  }
+  else if (handle->state == process_handle_t::TERMINATED) {
+    SET_STRING_ELT(ans, 0, mkChar("terminated"));
+  }
+  else if (handle->state == process_handle_t::RUNNING) {
+    SET_STRING_ELT(ans, 0, mkChar("running"));
+  }
+  else {
+    SET_STRING_ELT(ans, 0, mkChar("not-started"));
+  }
+
+  /* ans */
+  UNPROTECT(1);
+  return ans;
+}
+
+
+SEXP C_process_terminate (SEXP _handle)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+  try_run(&process_handle_t::terminate, handle);
+  return allocate_TRUE();
+}
+
+
+SEXP C_process_kill (SEXP _handle)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+  try_run(&process_handle_t::kill, handle);
+  return allocate_TRUE();
+}
+
+
+SEXP C_process_send_signal (SEXP _handle, SEXP _signal)
+{
+  process_handle_t * handle = extract_process_handle(_handle);
+  if (!is_single_integer(_signal)) {
+    Rf_error("`signal` must be a single integer value");
+  }
+
+  int signal = INTEGER_DATA(_signal)[0];
+  try_run(&process_handle_t::send_signal, handle, signal);
+
+  return allocate_TRUE();
+}
+
+
+SEXP C_process_exists (SEXP _pid)
+{
+  if (!is_single_integer(_pid)) {
+    Rf_error("`pid` must be a single integer value");
+  }
+
+  int pid = INTEGER_DATA(_pid)[0];
+  bool ret = subprocess::process_exists(static_cast<pid_type>(pid));
+
+  return allocate_single_bool(ret);
+}
+
+
+SEXP C_fork_server_start ()
+{
+  bool ret = try_run(&fork_server_start);
+  return allocate_single_bool(ret);
+}
+
+
+SEXP C_fork_server_stop ()
+{
+  bool ret = try_run(&fork_server_stop);
+  return allocate_single_bool(ret);
+}
+
+
+/* --- process pool ------------------------------------------------- */
+
+static void C_process_pool_finalizer (SEXP _ptr)
+{
+  process_pool * pool = (process_pool*)R_ExternalPtrAddr(_ptr);
+  if (!pool) return;
+
+  pool->~process_pool();
+  Free(pool);
+  R_ClearExternalPtr(_ptr);
+}
+
+
+static process_pool * extract_process_pool (SEXP _pool)
+{
+  if (TYPEOF(_pool) != EXTPTRSXP) {
+    Rf_error("`pool` must be an external pointer");
+  }
+
+  void * c_ptr = R_ExternalPtrAddr(_pool);
+  if (!c_ptr) {
+    Rf_error("process pool has been closed");
+  }
+
+  return (process_pool*)c_ptr;
+}
+
+
+SEXP C_process_pool_start (SEXP _command, SEXP _arguments, SEXP _environment, SEXP _workdir,
+                           SEXP _termination_mode, SEXP _options, SEXP _size, SEXP _protocol,
+                           SEXP _inflight)
+{
+  if (!is_nonempty_string(_command)) {
+    Rf_error("`command` must be a non-empty string");
+  }
+  if (!isString(_arguments)) {
+    Rf_error("invalid value for `arguments`");
+  }
+  if (!isString(_environment)) {
+    Rf_error("invalid value for `environment`");
+  }
+  if (!is_single_string_or_NULL(_workdir)) {
+    Rf_error("`workdir` must be a non-empty string");
+  }
+  if (!is_nonempty_string(_termination_mode)) {
+    Rf_error("`termination_mode` must be a non-emptry string");
+  }
+  if (!is_single_integer(_size) || INTEGER_DATA(_size)[0] < 1) {
+    Rf_error("`size` must be a single positive integer value");
+  }
+  if (!is_nonempty_string(_protocol)) {
+    Rf_error("`protocol` must be a non-empty string");
+  }
+  if (!is_single_integer(_inflight) || INTEGER_DATA(_inflight)[0] < 1) {
+    Rf_error("`inflight` must be a single positive integer value");
+  }
+
+  spawn_options options = extract_spawn_options(_options);
+  const char * workdir = extract_workdir(_workdir);
+  process_handle_t::termination_mode_type termination_mode =
+    extract_termination_mode(_termination_mode);
+
+  const char * protocol_name = CHAR(STRING_ELT(_protocol, 0));
+  process_pool::protocol_type protocol;
+  if (!strcmp(protocol_name, "line")) {
+    protocol = process_pool::PROTOCOL_LINE;
+  }
+  else if (!strcmp(protocol_name, "frame")) {
+    protocol = process_pool::PROTOCOL_FRAME;
+  }
+  else {
+    Rf_error("unknown protocol: %s", protocol_name);
+  }
+
+  const char * command = translateChar(STRING_ELT(_command, 0));
+  char ** arguments    = to_C_array(_arguments);
+  char ** environment  = to_C_array(_environment);
+  size_t size          = static_cast<size_t>(INTEGER_DATA(_size)[0]);
+  size_t inflight      = static_cast<size_t>(INTEGER_DATA(_inflight)[0]);
+
+  /* Calloc() handles memory allocation errors internally */
+  process_pool * pool = (process_pool*)Calloc(1, process_pool);
+
+  char message[BUFFER_SIZE];
+  bool success = try_catch(message, sizeof(message), [&] {
+    new (pool) process_pool(command, arguments, environment, workdir, termination_mode,
+                            options, size, protocol, inflight);
+  });
+
+  free_C_array(arguments);
+  free_C_array(environment);
+
+  if (!success) {
+    Free(pool);
+    Rf_error("%s", message);
+  }
+
+  SEXP ptr;
+  PROTECT(ptr = R_MakeExternalPtr(pool, install("process_pool"), R_NilValue));
+  R_RegisterCFinalizerEx(ptr, C_process_pool_finalizer, TRUE);
+
+  /* ptr */
+  UNPROTECT(1);
+  return ptr;
+}
+
+
+/*
+ * Each element of a character vector, or each raw vector of a list,
+ * is a single request.
+ */
+SEXP C_process_pool_submit (SEXP _pool, SEXP _requests)
+{
+  process_pool * pool = extract_process_pool(_pool);
+
+  size_t count = static_cast<size_t>(LENGTH(_requests));
+  input_buffer * requests = (input_buffer *)R_alloc(count + 1, sizeof(input_buffer));
+
+  if (isString(_requests)) {
+    for (size_t i = 0; i < count; ++i) {
+      SEXP element = STRING_ELT(_requests, i);
+      if (element == NA_STRING) {
+        Rf_error("requests cannot be NA");
+      }
+      requests[i].data   = translateChar(element);
+      requests[i].length = strlen(requests[i].data);
+    }
+  }
+  else if (TYPEOF(_requests) == VECSXP) {
+    for (size_t i = 0; i < count; ++i) {
+      SEXP element = VECTOR_ELT(_requests, i);
+      if (TYPEOF(element) != RAWSXP) {
+        Rf_error("`requests` must be a character vector or a list of raw vectors");
+      }
+      requests[i].data   = (const char *)RAW(element);
+      requests[i].length = static_cast<size_t>(LENGTH(element));
     }
-  };
+  }
+  else {
+    Rf_error("`requests` must be a character vector or a list of raw vectors");
+  }
 
-  // however termination goes, close pipe handles and free memory
-  try_run(try_terminate);
-  handle->~process_handle_t();
-  Free(handle);
+  uint64_t * ids = (uint64_t *)R_alloc(count + 1, sizeof(uint64_t));
+  try_run(&process_pool::submit, pool, requests, count, ids);
 
-  R_ClearExternalPtr(ptr); /* not really needed */
-}
+  SEXP ans;
+  PROTECT(ans = allocVector(REALSXP, count));
+  for (size_t i = 0; i < count; ++i) {
+    REAL(ans)[i] = static_cast<double>(ids[i]);
+  }
 
+  /* ans */
+  UNPROTECT(1);
+  return ans;
+}
 
 
-SEXP C_process_read (SEXP _handle, SEXP _pipe, SEXP _timeout)
+SEXP C_process_pool_collect (SEXP _pool, SEXP _max, SEXP _timeout, SEXP _binary)
 {
-  process_handle_t * handle = extract_process_handle(_handle);
+  process_pool * pool = extract_process_pool(_pool);
 
-  if (!is_nonempty_string(_pipe)) {
-    Rf_error("`pipe` must be a single character value");
+  if (!isReal(_max) || LENGTH(_max) != 1 || !(REAL(_max)[0] >= 0)) {
+    Rf_error("`max` must be a single non-negative number");
   }
   if (!is_single_integer(_timeout)) {
     Rf_error("`timeout` must be a single integer value");
   }
+  if (!is_single_logical(_binary)) {
+    Rf_error("`binary` must be a single logical value");
+  }
 
-  /* extract timeout */
-  int timeout = INTEGER_DATA(_timeout)[0];
-
-  /* determine which pipe */
-  const char * pipe = translateChar(STRING_ELT(_pipe, 0));
-  pipe_type which_pipe;
+  double limit = REAL(_max)[0];
+  size_t max   = (limit >= (double)SIZE_MAX) ? SIZE_MAX : static_cast<size_t>(limit);
+  int timeout  = INTEGER_DATA(_timeout)[0];
+  bool binary  = LOGICAL_DATA(_binary)[0] == TRUE;
+
+  /* results are freed by the garbage collector should Rf_error() jump */
+  SEXP owner;
+  vector<process_pool::result> & results = *owned_by_R<vector<process_pool::result>>(&owner);
+  PROTECT(owner);
+
+  char message[BUFFER_SIZE];
+  bool success = try_catch(message, sizeof(message), [&] {
+    pool->collect(results, max, timeout);
+  });
+  if (!success) {
+    release_native<vector<process_pool::result>>(owner);
+    Rf_error("%s", message);
+  }
 
-  if (!strncmp(pipe, "stdout", 6))
-    which_pipe = PIPE_STDOUT;
-  else if (!strncmp(pipe, "stderr", 6))
-    which_pipe = PIPE_STDERR;
-  else if (!strncmp(pipe, "both", 4))
-    which_pipe = PIPE_BOTH;
-  else {
-    Rf_error("unrecognized `pipe` value");
+  /* a response which is not a valid R string is reported as failed */
+  if (!binary) {
+    for (process_pool::result & result : results) {
+      if (result.data.size() > INT_MAX ||
+          (result.data.size() && memchr(result.data.data(), '\0', result.data.size())))
+      {
+        result.failed = true;
+      }
+    }
   }
 
-  try_run(&process_handle_t::read, handle, which_pipe, timeout);
+  R_xlen_t count = static_cast<R_xlen_t>(results.size());
+  SEXP ans, nms, ids, workers, failed, output;
+  PROTECT(ans = allocVector(VECSXP, 4));
+  PROTECT(nms = allocVector(STRSXP, 4));
+  PROTECT(ids = allocVector(REALSXP, count));
+  PROTECT(workers = allocVector(INTSXP, count));
+  PROTECT(failed = allocVector(LGLSXP, count));
+  PROTECT(output = allocVector(binary ? VECSXP : STRSXP, count));
+
+  for (R_xlen_t i = 0; i < count; ++i) {
+    const process_pool::result & result = results[i];
+    REAL(ids)[i] = static_cast<double>(result.id);
+    INTEGER(workers)[i] = static_cast<int>(result.worker) + 1;
+    LOGICAL(failed)[i] = result.failed;
+
+    if (binary) {
+      SEXP data = allocVector(RAWSXP, result.data.size());
+      SET_VECTOR_ELT(output, i, data);
+      if (result.data.size()) {
+        memcpy(RAW(data), result.data.data(), result.data.size());
+      }
+    }
+    else if (result.failed) {
+      SET_STRING_ELT(output, i, NA_STRING);
+    }
+    else {
+      SET_STRING_ELT(output, i, mkCharLenCE(result.data.data(), static_cast<int>(result.data.size()),
+                                            CE_NATIVE));
+    }
+  }
+  release_native<vector<process_pool::result>>(owner);
+
+  SET_VECTOR_ELT(ans, 0, ids);
+  SET_STRING_ELT(nms, 0, mkChar("id"));
+  SET_VECTOR_ELT(ans, 1, workers);
+  SET_STRING_ELT(nms, 1, mkChar("worker"));
+  SET_VECTOR_ELT(ans, 2, failed);
+  SET_STRING_ELT(nms, 2, mkChar("failed"));
+  SET_VECTOR_ELT(ans, 3, output);
+  SET_STRING_ELT(nms, 3, mkChar("output"));
+  setAttrib(ans, R_NamesSymbol, nms);
 
-  /* produce the result - a list of one or two elements */
-  SEXP ans, nms;
-  PROTECT(ans = allocVector(VECSXP, 2));
-  PROTECT(nms = allocVector(STRSXP, 2));
+  /* owner, ans, nms, ids, workers, failed, output */
+  UNPROTECT(7);
+  return ans;
+}
 
-  SET_VECTOR_ELT(ans, 0, ScalarString(mkChar(handle->stdout_.data())));
-  SET_STRING_ELT(nms, 0, mkChar("stdout"));
 
-  SET_VECTOR_ELT(ans, 1, ScalarString(mkChar(handle->stderr_.data())));
-  SET_STRING_ELT(nms, 1, mkChar("stderr"));
+SEXP C_process_pool_stats (SEXP _pool)
+{
+  process_pool * pool = extract_process_pool(_pool);
+  process_pool::statistics stats = try_run(&process_pool::stats, pool);
+
+  const char * names[] = { "submitted", "completed", "failed", "queued", "running", "ready",
+                           "idle", "alive", "restarts", "elapsed", "throughput" };
+  double values[] = {
+    static_cast<double>(stats.submitted), static_cast<double>(stats.completed),
+    static_cast<double>(stats.failed), static_cast<double>(stats.queued),
+    static_cast<double>(stats.running), static_cast<double>(stats.ready),
+    static_cast<double>(stats.idle), static_cast<double>(stats.alive),
+    static_cast<double>(stats.restarts), stats.elapsed,
+    stats.elapsed > 0 ? stats.completed / stats.elapsed : 0
+  };
+  const int count = sizeof(values) / sizeof(values[0]);
 
-  /* set names */
+  SEXP ans, nms;
+  PROTECT(ans = allocVector(REALSXP, count));
+  PROTECT(nms = allocVector(STRSXP, count));
+  for (int i = 0; i < count; ++i) {
+    REAL(ans)[i] = values[i];
+    SET_STRING_ELT(nms, i, mkChar(names[i]));
+  }
   setAttrib(ans, R_NamesSymbol, nms);
 
   /* ans, nms */
@@ -255,133 +1668,368 @@ SEXP C_process_read (SEXP _handle, SEXP _pipe, SEXP _timeout)
 }
 
 
-SEXP C_process_close_input (SEXP _handle)
+SEXP C_process_pool_close (SEXP _pool)
 {
-  process_handle_t * handle = extract_process_handle(_handle);
-  try_run(&process_handle_t::close_input, handle);
+  if (TYPEOF(_pool) != EXTPTRSXP) {
+    Rf_error("`pool` must be an external pointer");
+  }
+  C_process_pool_finalizer(_pool);
   return allocate_TRUE();
 }
 
 
-SEXP C_process_write (SEXP _handle, SEXP _message)
-{
-  process_handle_t * handle = extract_process_handle(_handle);
+/* --- event loop --------------------------------------------------- */
 
-  if (!is_nonempty_string(_message)) {
-    Rf_error("`message` must be a single character value");
-  }
+/*
+ * Callbacks are run from R's event loop: a single input handler waits
+ * on the descriptor of an event_watcher, which stands for pipes and
+ * exit notifications of all handles with callbacks. The handle is
+ * preserved while it has callbacks so that a child whose handle is no
+ * longer referenced in R still reports.
+ */
+
+#ifndef SUBPROCESS_WINDOWS
+
+/* any number R does not use for its own handlers */
+static const int event_activity = 31;
+
+struct event_callbacks {
+  SEXP handle, on_output, on_exit;
+  bool binary;
+};
 
-  const char * message = translateChar(STRING_ELT(_message, 0));
-  size_t ret = try_run(&process_handle_t::write, handle, message, strlen(message));
+/* never destroyed, the input handler is never removed */
+static event_watcher * watcher = nullptr;
 
-  return allocate_single_int((int)ret);
+static std::map<process_handle_t *, event_callbacks> callbacks;
+
+
+static void replace_callback (SEXP & _slot, SEXP _callback)
+{
+  if (_callback != R_NilValue) R_PreserveObject(_callback);
+  if (_slot != R_NilValue) R_ReleaseObject(_slot);
+  _slot = _callback;
 }
 
 
-SEXP C_process_wait (SEXP _handle, SEXP _timeout)
+static event_callbacks & callbacks_of (process_handle_t * _handle, SEXP _object)
 {
-  /* extract timeout */
-  if (!is_single_integer(_timeout)) {
-    Rf_error("`timeout` must be a single integer value");
+  auto it = callbacks.find(_handle);
+  if (it == callbacks.end()) {
+    R_PreserveObject(_object);
+    event_callbacks entry = { _object, R_NilValue, R_NilValue, false };
+    it = callbacks.insert(std::make_pair(_handle, entry)).first;
   }
+  return it->second;
+}
 
-  int timeout = INTEGER_DATA(_timeout)[0];
 
-  /* extract handle */
-  process_handle_t * handle = extract_process_handle(_handle);
+/* a handle without callbacks is left to the garbage collector */
+static void release_if_done (process_handle_t * _handle)
+{
+  auto it = callbacks.find(_handle);
+  if (it == callbacks.end()) return;
+  if (it->second.on_output != R_NilValue || it->second.on_exit != R_NilValue) return;
 
-  /* check the process */
-  try_run(&process_handle_t::wait, handle, timeout);
+  SEXP object = it->second.handle;
+  callbacks.erase(it);
+  R_ReleaseObject(object);
+}
 
-  return C_process_return_code(_handle);
+
+static void forget_callbacks (process_handle_t * _handle)
+{
+  auto it = callbacks.find(_handle);
+  if (it == callbacks.end()) return;
+
+  watcher->forget(*_handle, PIPE_BOTH, true);
+  replace_callback(it->second.on_output, R_NilValue);
+  replace_callback(it->second.on_exit, R_NilValue);
+  release_if_done(_handle);
 }
 
 
-SEXP C_process_return_code (SEXP _handle)
+/* errors are printed by R_tryEval() and do not leave the event loop */
+static void call_callback (SEXP _callback, SEXP _argument)
 {
-  /* extract handle */
-  process_handle_t * handle = extract_process_handle(_handle);
+  SEXP call;
+  PROTECT(call = lang2(_callback, _argument));
+  int failed = 0;
+  R_tryEval(call, R_GlobalEnv, &failed);
 
-  if (handle->state == process_handle_t::EXITED ||
-      handle->state == process_handle_t::TERMINATED)
-    return allocate_single_int(handle->return_code);
-  else
-    return allocate_single_int(NA_INTEGER);
+  /* call */
+  UNPROTECT(1);
 }
 
 
-SEXP C_process_state (SEXP _handle)
+static bool output_ended (const process_handle_t * _handle)
 {
-  process_handle_t * handle = extract_process_handle(_handle);
+  return (_handle->pipe_stdout == HANDLE_CLOSED || _handle->stdout_.eof) &&
+         (_handle->pipe_stderr == HANDLE_CLOSED || _handle->stderr_.eof);
+}
 
-  /* refresh the handle */
-  try_run(&process_handle_t::wait, handle, TIMEOUT_IMMEDIATE);
 
-  /* answer */
-  SEXP ans;
-  PROTECT(ans = allocVector(STRSXP, 1));
+/*
+ * Everything available in `_pipes` is read at once, through the same
+ * buffers process_read() uses, and handed over in a single call; an
+ * incomplete line waits for the rest unless the pipe has ended.
+ */
+static void deliver_output (process_handle_t * _handle, pipe_type _pipes)
+{
+  auto it = callbacks.find(_handle);
+  if (it == callbacks.end() || it->second.on_output == R_NilValue) return;
+  bool binary = it->second.binary;
+
+  char message[BUFFER_SIZE];
+  bool success = try_catch(message, sizeof(message), [&] {
+    _handle->read(_pipes, TIMEOUT_IMMEDIATE, true, binary);
+  });
+  if (!success) {
+    REprintf("%s\n", message);
+    watcher->forget(*_handle, _pipes, false);
+    return;
+  }
 
-  if (handle->state == process_handle_t::EXITED) {
-    SET_STRING_ELT(ans, 0, mkChar("exited"));
+  pipe_writer * writers[2] = { &_handle->stdout_, &_handle->stderr_ };
+  const char * names[2] = { "stdout", "stderr" };
+
+  /* there is no .Call() to release memory taken by R_alloc() */
+  const void * vmax = vmaxget();
+
+  SEXP output, nms;
+  PROTECT(output = allocVector(VECSXP, 2));
+  PROTECT(nms = allocVector(STRSXP, 2));
+
+  R_xlen_t total = 0;
+  int ended = 0;
+  for (int i = 0; i < 2; ++i) {
+    int which = i + 1;
+    SEXP part;
+    if (_pipes & which) {
+      if (binary) {
+        part = pipe_to_RAWSXP(*writers[i]);
+      }
+      else if (lines_fit(*writers[i])) {
+        part = pipe_to_lines(*writers[i], writers[i]->eof);
+      }
+      else {
+        REprintf("output line of process %d too long to fit in a single string, use type = \"raw\"\n",
+                 _handle->child_id);
+        part = allocVector(STRSXP, 0);
+      }
+      if (writers[i]->eof) ended |= which;
+    }
+    else {
+      part = allocVector(binary ? RAWSXP : STRSXP, 0);
+    }
+    SET_VECTOR_ELT(output, i, part);
+    SET_STRING_ELT(nms, i, mkChar(names[i]));
+    total += XLENGTH(part);
   }
-  else if (handle->state == process_handle_t::TERMINATED) {
-    SET_STRING_ELT(ans, 0, mkChar("terminated"));
+  setAttrib(output, R_NamesSymbol, nms);
+
+  if (ended) {
+    watcher->forget(*_handle, static_cast<pipe_type>(ended), false);
   }
-  else if (handle->state == process_handle_t::RUNNING) {
-    SET_STRING_ELT(ans, 0, mkChar("running"));
+
+  /* the callback might replace itself */
+  SEXP callback = PROTECT(it->second.on_output);
+  if (total > 0) {
+    call_callback(callback, output);
   }
-  else {
-    SET_STRING_ELT(ans, 0, mkChar("not-started"));
+
+  /* the handle is gone if the callback dropped the last reference */
+  it = callbacks.find(_handle);
+  if (it != callbacks.end() && it->second.on_output == callback && output_ended(_handle)) {
+    replace_callback(it->second.on_output, R_NilValue);
+    release_if_done(_handle);
   }
 
-  /* ans */
-  UNPROTECT(1);
-  return ans;
+  /* output, nms, callback */
+  UNPROTECT(3);
+  vmaxset(vmax);
 }
 
 
-SEXP C_process_terminate (SEXP _handle)
+/* exit is reported once; the argument is what process_return_code() returns */
+static void deliver_exit (process_handle_t * _handle)
 {
-  process_handle_t * handle = extract_process_handle(_handle);
-  try_run(&process_handle_t::terminate, handle);
-  return allocate_TRUE();
+  auto it = callbacks.find(_handle);
+  if (it == callbacks.end() || it->second.on_exit == R_NilValue) return;
+
+  SEXP code;
+  PROTECT(code = allocate_single_int(
+    (_handle->state == process_handle_t::EXITED || _handle->state == process_handle_t::TERMINATED) ?
+      _handle->return_code : NA_INTEGER));
+
+  SEXP callback = PROTECT(it->second.on_exit);
+  replace_callback(it->second.on_exit, R_NilValue);
+  release_if_done(_handle);
+
+  call_callback(callback, code);
+
+  /* code, callback */
+  UNPROTECT(2);
 }
 
 
-SEXP C_process_kill (SEXP _handle)
+/* R_ToplevelExec() stops an R error at the event it was raised for */
+static void deliver_output_of (void * _event)
 {
-  process_handle_t * handle = extract_process_handle(_handle);
-  try_run(&process_handle_t::kill, handle);
-  return allocate_TRUE();
+  const event_watcher::event & event = *static_cast<event_watcher::event *>(_event);
+  deliver_output(event.handle, event.exited ? PIPE_BOTH : static_cast<pipe_type>(event.pipes));
 }
 
+static void deliver_exit_of (void * _event)
+{
+  deliver_exit(static_cast<event_watcher::event *>(_event)->handle);
+}
 
-SEXP C_process_send_signal (SEXP _handle, SEXP _signal)
+
+static void event_dispatch (void *)
+{
+  vector<event_watcher::event> events;
+
+  char message[BUFFER_SIZE];
+  bool success = try_catch(message, sizeof(message), [&] {
+    watcher->ready(events);
+  });
+  if (!success) {
+    REprintf("%s\n", message);
+    return;
+  }
+
+  // output comes first: the child might have written it just before
+  // it exited
+  for (event_watcher::event & event : events) {
+    if (event.pipes || event.exited) {
+      R_ToplevelExec(deliver_output_of, &event);
+    }
+    if (event.exited) {
+      R_ToplevelExec(deliver_exit_of, &event);
+    }
+  }
+}
+
+
+static event_watcher * event_loop ()
+{
+  if (watcher) return watcher;
+
+  char message[BUFFER_SIZE];
+  event_watcher * created = nullptr;
+  bool success = try_catch(message, sizeof(message), [&] {
+    created = new event_watcher();
+  });
+  if (!success) {
+    Rf_error("%s", message);
+  }
+
+  watcher = created;
+  addInputHandler(R_InputHandlers, watcher->fd(), event_dispatch, event_activity);
+  return watcher;
+}
+
+
+SEXP C_process_on_output (SEXP _handle, SEXP _callback, SEXP _binary)
 {
   process_handle_t * handle = extract_process_handle(_handle);
-  if (!is_single_integer(_signal)) {
-    Rf_error("`signal` must be a single integer value");
+
+  if (_callback != R_NilValue && !isFunction(_callback)) {
+    Rf_error("`callback` must be a function or NULL");
+  }
+  if (!is_single_logical(_binary)) {
+    Rf_error("`binary` must be a single logical value");
+  }
+  if (_callback != R_NilValue && handle->reader) {
+    Rf_error("output callbacks cannot be used together with the background reader");
   }
 
-  int signal = INTEGER_DATA(_signal)[0];
-  try_run(&process_handle_t::send_signal, handle, signal);
+  /* nothing will come from pipes which have ended */
+  if (output_ended(handle)) {
+    _callback = R_NilValue;
+  }
+  if (_callback == R_NilValue && callbacks.find(handle) == callbacks.end()) {
+    return allocate_TRUE();
+  }
+
+  event_watcher * events = event_loop();
+
+  char message[BUFFER_SIZE];
+  bool success = try_catch(message, sizeof(message), [&] {
+    if (_callback == R_NilValue) {
+      events->forget(*handle, PIPE_BOTH, false);
+    }
+    else {
+      events->watch_output(*handle, PIPE_BOTH);
+    }
+  });
+  if (!success) {
+    Rf_error("%s", message);
+  }
+
+  event_callbacks & entry = callbacks_of(handle, _handle);
+  replace_callback(entry.on_output, _callback);
+  entry.binary = LOGICAL_DATA(_binary)[0] == TRUE;
+  release_if_done(handle);
 
   return allocate_TRUE();
 }
 
 
-SEXP C_process_exists (SEXP _pid)
+SEXP C_process_on_exit (SEXP _handle, SEXP _callback)
 {
-  if (!is_single_integer(_pid)) {
-    Rf_error("`pid` must be a single integer value");
+  process_handle_t * handle = extract_process_handle(_handle);
+
+  if (_callback != R_NilValue && !isFunction(_callback)) {
+    Rf_error("`callback` must be a function or NULL");
   }
 
-  int pid = INTEGER_DATA(_pid)[0];
-  bool ret = subprocess::process_exists(static_cast<pid_type>(pid));
+  if (_callback == R_NilValue && callbacks.find(handle) == callbacks.end()) {
+    return allocate_TRUE();
+  }
 
-  return allocate_single_bool(ret);
+  event_watcher * events = event_loop();
+
+  /* stdin stands for "no output pipe" */
+  char message[BUFFER_SIZE];
+  bool success = try_catch(message, sizeof(message), [&] {
+    if (_callback == R_NilValue) {
+      events->forget(*handle, PIPE_STDIN, true);
+    }
+    else {
+      events->watch_exit(*handle);
+    }
+  });
+  if (!success) {
+    Rf_error("%s", message);
+  }
+
+  event_callbacks & entry = callbacks_of(handle, _handle);
+  replace_callback(entry.on_exit, _callback);
+  release_if_done(handle);
+
+  return allocate_TRUE();
+}
+
+#else /* SUBPROCESS_WINDOWS */
+
+static void forget_callbacks (process_handle_t * _handle) { }
+
+SEXP C_process_on_output (SEXP _handle, SEXP _callback, SEXP _binary)
+{
+  Rf_error("output callbacks are not supported in Windows");
+  return R_NilValue;
 }
 
+SEXP C_process_on_exit (SEXP _handle, SEXP _callback)
+{
+  Rf_error("exit callbacks are not supported in Windows");
+  return R_NilValue;
+}
+
+#endif /* SUBPROCESS_WINDOWS */
+
 
 SEXP C_known_signals ()
 {
@@ -488,6 +2136,11 @@ static int is_single_integer (SEXP _obj)
   return isInteger(_obj) && (LENGTH(_obj) == 1);
 }
 
+static int is_single_logical (SEXP _obj)
+{
+  return isLogical(_obj) && (LENGTH(_obj) == 1);
+}
+
 
 static char ** to_C_array (SEXP _array)
 {
@@ -514,6 +2167,20 @@ static void free_C_array (char ** _array)
   Free(_array);
 }
 
+/*
+ * Same as to_C_array() but strings are not copied and the array is
+ * allocated with R_alloc(), so it is released with vmaxset().
+ */
+static char ** borrow_C_array (SEXP _array)
+{
+  char ** ret = (char**)R_alloc(LENGTH(_array) + 1, sizeof(char *));
+  for (int i=0; i<LENGTH(_array); ++i) {
+    ret[i] = const_cast<char*>(translateChar(STRING_ELT(_array, i)));
+  }
+  ret[LENGTH(_array)] = NULL;
+  return ret;
+}
+
 SEXP allocate_single_int (int _value)
 {
   SEXP ans;
@@ -523,6 +2190,115 @@ SEXP allocate_single_int (int _value)
   return ans;
 }
 
+/*
+ * Create a R string from a single line; carriage return characters
+ * and NUL bytes, which an R string cannot hold, are removed. The line
+ * is copied only if it contains any of them.
+ */
+static SEXP line_to_CHARSXP (const char * _line, size_t _length)
+{
+  if (_length > INT_MAX) {
+    Rf_error("line too long to fit in a single string, use type = \"raw\"");
+  }
+
+  if (!memchr(_line, '\r', _length) && !memchr(_line, '\0', _length)) {
+    return mkCharLenCE(_line, (int)_length, CE_NATIVE);
+  }
+
+  // R_alloc'ed memory is released when .Call() returns
+  char * copy = R_alloc(_length, sizeof(char));
+  size_t copied = 0;
+  for (const char * ptr = _line; ptr < _line + _length; ++ptr) {
+    if (*ptr != '\r' && *ptr != '\0') copy[copied++] = *ptr;
+  }
+
+  return mkCharLenCE(copy, (int)copied, CE_NATIVE);
+}
+
+
+/*
+ * Lines longer than INT_MAX bytes do not fit in an R string; this
+ * tells whether pipe_to_lines() can convert the buffer without
+ * raising an error.
+ */
+static bool lines_fit (const pipe_writer & _pipe)
+{
+  const char * begin = _pipe.data(), * end = begin + _pipe.size();
+  for (const char * line = begin; line < end; ) {
+    const char * eol = (const char*)memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+    if (static_cast<size_t>(eol - line) > INT_MAX) return false;
+    line = eol + 1;
+  }
+  return true;
+}
+
+
+/*
+ * Split buffer's contents into lines and return them as a character
+ * vector. The buffer is not 0-terminated, R strings are created
+ * directly from the data block.
+ *
+ * If `_incomplete` is false, the last line - if not terminated with
+ * a new line character - is handed back to the buffer and will be
+ * returned, completed, by the next read.
+ */
+static SEXP pipe_to_lines (pipe_writer & _pipe, bool _incomplete)
+{
+  const char * begin = _pipe.data(), * end = begin + _pipe.size();
+
+  // count complete lines and find where the last one ends
+  R_xlen_t count = 0;
+  const char * tail = begin;
+  for (const char * ptr = begin;
+       (ptr = (const char*)memchr(ptr, '\n', end - ptr)) != NULL;
+       tail = ++ptr)
+  {
+    ++count;
+  }
+
+  if (tail < end) {
+    if (_incomplete) {
+      ++count;
+    }
+    else {
+      _pipe.keep(end - tail);
+      end = tail;
+    }
+  }
+
+  SEXP ans;
+  PROTECT(ans = allocVector(STRSXP, count));
+
+  const char * line = begin;
+  for (R_xlen_t i = 0; i < count; ++i) {
+    const char * eol = (const char*)memchr(line, '\n', end - line);
+    if (!eol) eol = end;
+    SET_STRING_ELT(ans, i, line_to_CHARSXP(line, eol - line));
+    line = eol + 1;
+  }
+
+  /* ans */
+  UNPROTECT(1);
+  return ans;
+}
+
+/*
+ * Binary output is copied as-is: no verification, no terminator.
+ */
+static SEXP pipe_to_RAWSXP (const pipe_writer & _pipe)
+{
+  SEXP ans;
+  PROTECT(ans = allocVector(RAWSXP, _pipe.size()));
+  if (_pipe.size() > 0) {
+    memcpy(RAW(ans), _pipe.data(), _pipe.size());
+  }
+
+  /* ans */
+  UNPROTECT(1);
+  return ans;
+}
+
 static SEXP allocate_single_bool (bool _value)
 {
   SEXP ans;
@@ -16,16 +16,37 @@ extern "C" {
 #endif
 
 
-EXPORT SEXP C_process_spawn(SEXP _command, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode);
+EXPORT SEXP C_process_spawn(SEXP _command, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options);
+EXPORT SEXP C_process_spawn_many(SEXP _commands, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options);
+EXPORT SEXP C_process_spawn_pipeline(SEXP _commands, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options);
+EXPORT SEXP C_process_run_parallel(SEXP _commands, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options, SEXP _max_jobs, SEXP _timeout, SEXP _binary);
 
-EXPORT SEXP C_process_read(SEXP _handle, SEXP _pipe, SEXP _timeout);
+
+EXPORT SEXP C_process_read(SEXP _handle, SEXP _pipe, SEXP _timeout, SEXP _flush, SEXP _incomplete);
+
+EXPORT SEXP C_process_read_raw(SEXP _handle, SEXP _pipe, SEXP _timeout, SEXP _flush);
+
+EXPORT SEXP C_process_read_until(SEXP _handle, SEXP _pipe, SEXP _pattern, SEXP _fixed, SEXP _timeout, SEXP _binary);
+EXPORT SEXP C_process_shell_run(SEXP _handle, SEXP _command, SEXP _marker, SEXP _timeout, SEXP _binary);
+
+EXPORT SEXP C_process_eof (SEXP _handle, SEXP _pipe);
 
 EXPORT SEXP C_process_close_input (SEXP _handle);
 
-EXPORT SEXP C_process_write(SEXP _handle, SEXP _message);
+EXPORT SEXP C_process_write(SEXP _handle, SEXP _message, SEXP _sep, SEXP _timeout);
+
+EXPORT SEXP C_process_write_file(SEXP _handle, SEXP _path, SEXP _offset, SEXP _length, SEXP _timeout);
+
+EXPORT SEXP C_process_pending_input(SEXP _handle);
+
+EXPORT SEXP C_process_pipe_size(SEXP _handle);
+
+EXPORT SEXP C_process_communicate(SEXP _handle, SEXP _input, SEXP _sep, SEXP _timeout, SEXP _binary);
 
 EXPORT SEXP C_process_wait(SEXP _handle, SEXP _timeout);
 
+EXPORT SEXP C_process_poll(SEXP _handles, SEXP _timeout);
+
 EXPORT SEXP C_process_return_code(SEXP _handle);
 
 EXPORT SEXP C_process_state(SEXP _handle);
@@ -38,6 +59,24 @@ EXPORT SEXP C_process_send_signal(SEXP _handle, SEXP _signal);
 
 EXPORT SEXP C_process_exists(SEXP _pid);
 
+EXPORT SEXP C_fork_server_start();
+
+EXPORT SEXP C_fork_server_stop();
+
+EXPORT SEXP C_process_pool_start(SEXP _command, SEXP _arguments, SEXP _environment, SEXP _workdir, SEXP _termination_mode, SEXP _options, SEXP _size, SEXP _protocol, SEXP _inflight);
+
+EXPORT SEXP C_process_pool_submit(SEXP _pool, SEXP _requests);
+
+EXPORT SEXP C_process_pool_collect(SEXP _pool, SEXP _max, SEXP _timeout, SEXP _binary);
+
+EXPORT SEXP C_process_pool_stats(SEXP _pool);
+
+EXPORT SEXP C_process_pool_close(SEXP _pool);
+
+EXPORT SEXP C_process_on_output(SEXP _handle, SEXP _callback, SEXP _binary);
+
+EXPORT SEXP C_process_on_exit(SEXP _handle, SEXP _callback);
+
 EXPORT SEXP C_known_signals();
 
 EXPORT SEXP C_signal (SEXP _signal, SEXP _handler);
@@ -10,19 +10,40 @@
 
 
 static const R_CallMethodDef callMethods[]  = {
-  { "C_process_spawn",        (DL_FUNC) &C_process_spawn,        5 },
-  { "C_process_read",         (DL_FUNC) &C_process_read,         3 },
-  { "C_process_close_input",  (DL_FUNC) &C_process_close_input,  1 },
-  { "C_process_write",        (DL_FUNC) &C_process_write,        2 },
-  { "C_process_wait",         (DL_FUNC) &C_process_wait,         2 },
-  { "C_process_return_code",  (DL_FUNC) &C_process_return_code,  1 },
-  { "C_process_state",        (DL_FUNC) &C_process_state,        1 },
-  { "C_process_terminate",    (DL_FUNC) &C_process_terminate,    1 },
-  { "C_process_kill",         (DL_FUNC) &C_process_kill,         1 },
-  { "C_process_send_signal",  (DL_FUNC) &C_process_send_signal,  2 },
-  { "C_process_exists",       (DL_FUNC) &C_process_exists,       1 },
-  { "C_known_signals",        (DL_FUNC) &C_known_signals,        0 },
-  { "C_signal",               (DL_FUNC) &C_signal,               2 },
+  { "C_process_spawn",          (DL_FUNC) &C_process_spawn,         6 },
+  { "C_process_spawn_many",     (DL_FUNC) &C_process_spawn_many,    6 },
+  { "C_process_spawn_pipeline", (DL_FUNC) &C_process_spawn_pipeline, 6 },
+  { "C_process_run_parallel",   (DL_FUNC) &C_process_run_parallel,  9 },
+  { "C_process_read",           (DL_FUNC) &C_process_read,          5 },
+  { "C_process_read_raw",       (DL_FUNC) &C_process_read_raw,      4 },
+  { "C_process_read_until",     (DL_FUNC) &C_process_read_until,    6 },
+  { "C_process_shell_run",      (DL_FUNC) &C_process_shell_run,     5 },
+  { "C_process_eof",            (DL_FUNC) &C_process_eof,           2 },
+  { "C_process_close_input",    (DL_FUNC) &C_process_close_input,   1 },
+  { "C_process_write",          (DL_FUNC) &C_process_write,         4 },
+  { "C_process_write_file",     (DL_FUNC) &C_process_write_file,    5 },
+  { "C_process_pending_input",  (DL_FUNC) &C_process_pending_input, 1 },
+  { "C_process_pipe_size",      (DL_FUNC) &C_process_pipe_size,     1 },
+  { "C_process_communicate",    (DL_FUNC) &C_process_communicate,   5 },
+  { "C_process_wait",           (DL_FUNC) &C_process_wait,          2 },
+  { "C_process_poll",           (DL_FUNC) &C_process_poll,          2 },
+  { "C_process_return_code",    (DL_FUNC) &C_process_return_code,   1 },
+  { "C_process_state",          (DL_FUNC) &C_process_state,         1 },
+  { "C_process_terminate",      (DL_FUNC) &C_process_terminate,     1 },
+  { "C_process_kill",           (DL_FUNC) &C_process_kill,          1 },
+  { "C_process_send_signal",    (DL_FUNC) &C_process_send_signal,   2 },
+  { "C_process_exists",         (DL_FUNC) &C_process_exists,        1 },
+  { "C_fork_server_start",      (DL_FUNC) &C_fork_server_start,     0 },
+  { "C_fork_server_stop",       (DL_FUNC) &C_fork_server_stop,      0 },
+  { "C_process_pool_start",     (DL_FUNC) &C_process_pool_start,    9 },
+  { "C_process_pool_submit",    (DL_FUNC) &C_process_pool_submit,   2 },
+  { "C_process_pool_collect",   (DL_FUNC) &C_process_pool_collect,  4 },
+  { "C_process_pool_stats",     (DL_FUNC) &C_process_pool_stats,    1 },
+  { "C_process_pool_close",     (DL_FUNC) &C_process_pool_close,    1 },
+  { "C_process_on_output",      (DL_FUNC) &C_process_on_output,     3 },
+  { "C_process_on_exit",        (DL_FUNC) &C_process_on_exit,       2 },
+  { "C_known_signals",          (DL_FUNC) &C_known_signals,         0 },
+  { "C_signal",                 (DL_FUNC) &C_signal,                2 },
   { NULL, NULL, 0 }
 };
 
@@ -1,21 +1,48 @@
 //#define _GNU_SOURCE             /* See feature_test_macros(7) */
 
 #include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <thread>
 
 #include <signal.h>
+#include <spawn.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#include <dirent.h>
 #include <dlfcn.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+/* not yet known to older C libraries; the same number in all
+ * architectures but alpha */
+#if !defined(SYS_pidfd_open) && !defined(__alpha__)
+#define SYS_pidfd_open 434
+#endif
+#if !defined(SYS_close_range) && !defined(__alpha__)
+#define SYS_close_range 436
+#endif
+#endif
+
 #include <fcntl.h>              /* Obtain O_* constant definitions */
 #include <unistd.h>
 
@@ -23,6 +50,16 @@
 #include "subprocess.h"
 
 
+/* posix_spawn_file_actions_addchdir_np() */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define SUBPROCESS_SPAWN_CHDIR
+#endif
+
+/* posix_spawn_file_actions_addclosefrom_np() */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define SUBPROCESS_SPAWN_CLOSEFROM
+#endif
+
 #ifdef SUBPROCESS_MACOS
 #include <mach/clock.h>
 #include <mach/mach.h>
@@ -157,13 +194,122 @@ static void set_non_block (int _fd) {
   }
 }
 
+#ifdef F_SETPIPE_SZ
+/* largest pipe an unprivileged process can ask for */
+static size_t pipe_max_size () {
+  static const size_t max_size = [] {
+    size_t value = 0;
+    FILE * file = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (file) {
+      if (fscanf(file, "%zu", &value) != 1) value = 0;
+      fclose(file);
+    }
+    return value ? value : 1024 * 1024;
+  }();
+  return max_size;
+}
+#endif
+
+/*
+ * Change capacity of a pipe; 0 leaves it as it is. A request above
+ * the system limit is capped and a failure leaves the current size.
+ *
+ * @return Capacity in bytes, or 0 if it cannot be queried.
+ */
+static size_t set_pipe_size (int _fd, size_t _size) {
+#ifdef F_SETPIPE_SZ
+  if (_size > 0) {
+    ignore_return_value(fcntl(_fd, F_SETPIPE_SZ, (int)std::min(_size, pipe_max_size())));
+  }
+  int rc = fcntl(_fd, F_GETPIPE_SZ);
+  return rc < 0 ? 0 : static_cast<size_t>(rc);
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Both ends are closed in exec(), so children spawned later do not
+ * hold each other's pipes open.
+ */
+static int pipe_cloexec (int _fds[2]) {
+#ifdef __linux__
+  return pipe2(_fds, O_CLOEXEC);
+#else
+  if (pipe(_fds) < 0) return -1;
+  fcntl(_fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(_fds[1], F_SETFD, FD_CLOEXEC);
+  return 0;
+#endif
+}
+
+
+/*
+ * Close descriptors from `_from` to `_to` (inclusive). close_range()
+ * is available since Linux 5.9; before that only the descriptors
+ * listed in /proc/self/fd are closed. getdents64() is called directly
+ * because opendir() allocates memory.
+ */
+static void close_fd_range (int _from, int _to)
+{
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, (unsigned)_from, (unsigned)_to, 0) == 0) {
+    return;
+  }
+#endif
+
+#ifdef __linux__
+  int dir = ::open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir >= 0) {
+    char buffer[4096];
+    long length;
+    while ((length = syscall(SYS_getdents64, dir, buffer, sizeof(buffer))) > 0) {
+      for (long offset = 0; offset < length; ) {
+        struct dirent64 * entry = reinterpret_cast<struct dirent64 *>(buffer + offset);
+        offset += entry->d_reclen;
+
+        int fd = 0;
+        const char * digit = entry->d_name;
+        for (; *digit >= '0' && *digit <= '9'; ++digit) {
+          fd = fd * 10 + (*digit - '0');
+        }
+        if (*digit || digit == entry->d_name) continue;   /* "." and ".." */
+        if (fd >= _from && fd <= _to && fd != dir) ::close(fd);
+      }
+    }
+    ::close(dir);
+    if (length == 0) return;
+  }
+#endif
+
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  if (max_fd < 0 || max_fd > 65536) max_fd = 65536;
+  for (long fd = _from; fd <= _to && fd < max_fd; ++fd) {
+    ::close(static_cast<int>(fd));
+  }
+}
+
+
+void close_descriptors (const int * _keep, size_t _count)
+{
+  int from = 3;
+  for (size_t i = 0; i < _count; ++i) {
+    if (_keep[i] > from) {
+      close_fd_range(from, _keep[i] - 1);
+    }
+    from = std::max(from, _keep[i] + 1);
+  }
+  close_fd_range(from, INT_MAX);
+}
+
 
 /* --- process_handle ----------------------------------------------- */
 
 process_handle_t::process_handle_t ()
   : child_handle(0),
     pipe_stdin(HANDLE_CLOSED), pipe_stdout(HANDLE_CLOSED),
-    pipe_stderr(HANDLE_CLOSED), state(NOT_STARTED)
+    pipe_stderr(HANDLE_CLOSED), pid_fd(HANDLE_CLOSED), state(NOT_STARTED),
+    pipe_capacity{ 0, 0, 0 }, reader(nullptr), dropped(0)
 { }
 
 
@@ -181,12 +327,13 @@ struct pipe_holder {
 
   int & operator [] (pipe_end _i) { return fds[_i]; }
 
+  pipe_holder () : fds{HANDLE_CLOSED, HANDLE_CLOSED} { }
+
   /**
-   * Zero the descriptor array and immediately try opening a (unnamed)
-   * pipe().
+   * Try opening a (unnamed) pipe().
    */
-  pipe_holder () : fds{HANDLE_CLOSED, HANDLE_CLOSED} {
-    if (pipe(fds) < 0) {
+  void open () {
+    if (pipe_cloexec(fds) < 0) {
       throw subprocess_exception(errno, "could not create a pipe");
     }
   }
@@ -202,272 +349,2654 @@ struct pipe_holder {
 
 
 /**
- * In most cases, when a negative value is returned the calling function
- * can consult the value of errno.
- *
- * @return 0 on success and negative on an error.
+ * Descriptors connected to child's standard streams in place of pipes.
+ * They are opened before the child is created and closed once it has
+ * its own copies. HANDLE_CLOSED means a pipe; STDOUT_FILENO for stderr
+ * means "the same as stdout", which works because stderr is always
+ * duplicated last.
  */
-void process_handle_t::spawn (const char * _command, char *const _arguments[],
-	               char *const _environment[], const char * _workdir,
-                 termination_mode_type _termination_mode)
-{
-  if (state != NOT_STARTED) {
-    throw subprocess_exception(EALREADY, "process already started");
-  }
+struct redirection_holder {
 
-  int rc = 0;
-  // can be addressed with PIPE_STDIN, PIPE_STDOUT, PIPE_STDERR
-  pipe_holder pipes[3];
-
-  /* spawn a child */
-  if ( (child_id = fork()) < 0) {
-    throw subprocess_exception(errno, "could not spawn a process");
-  }
+  int fds[3];
 
-  /* child should copy his ends of pipes and close his and parent's
-   * ends of pipes */
-  if (child_id == 0) {
+  explicit redirection_holder (const spawn_options & _options)
+    : fds{HANDLE_CLOSED, HANDLE_CLOSED, HANDLE_CLOSED}
+  {
+    // the destructor does not run if the constructor throws
     try {
-      dup2(pipes[PIPE_STDIN][pipe_holder::READ], STDIN_FILENO);
-      dup2(pipes[PIPE_STDOUT][pipe_holder::WRITE], STDOUT_FILENO);
-      dup2(pipes[PIPE_STDERR][pipe_holder::WRITE], STDERR_FILENO);
-
-      close(pipes[PIPE_STDIN][pipe_holder::READ]);
-      close(pipes[PIPE_STDIN][pipe_holder::WRITE]);
-      close(pipes[PIPE_STDOUT][pipe_holder::READ]);
-      close(pipes[PIPE_STDOUT][pipe_holder::WRITE]);
-      close(pipes[PIPE_STDERR][pipe_holder::READ]);
-      close(pipes[PIPE_STDERR][pipe_holder::WRITE]);
-
-      /* change directory */
-      if (_workdir != NULL) {
-        chdir(_workdir);
-      }
+      open(_options);
+    }
+    catch (...) {
+      release();
+      throw;
+    }
+  }
 
-      /* if termination mode is "group" start new session */
-      if (_termination_mode == TERMINATION_GROUP) {
-        setsid();
-      }
+  ~redirection_holder () {
+    release();
+  }
 
-      /* if environment is empty, use parent's environment */
-      if (!_environment) {
-        _environment = environ;
+  bool piped (int _stream) const { return fds[_stream] == HANDLE_CLOSED; }
+
+private:
+
+  void open (const spawn_options & _options)
+  {
+    for (int i = 0; i < 3; ++i) {
+      switch (_options.redirect[i]) {
+      case spawn_options::REDIRECT_PIPE:
+        break;
+
+      case spawn_options::REDIRECT_NULL:
+        fds[i] = open_file("/dev/null", i == PIPE_STDIN ? O_RDONLY : O_WRONLY);
+        break;
+
+      case spawn_options::REDIRECT_INHERIT:
+        // a copy above the standard streams so that dup2() order does not matter
+        if ((fds[i] = fcntl(i, F_DUPFD_CLOEXEC, STDERR_FILENO + 1)) < 0) {
+          throw subprocess_exception(errno, "could not duplicate descriptor " + std::to_string(i));
+        }
+        break;
+
+      case spawn_options::REDIRECT_FILE:
+        if (i == PIPE_STDIN) {
+          fds[i] = open_file(_options.redirect_path[i], O_RDONLY);
+        }
+        else {
+          fds[i] = open_file(_options.redirect_path[i], O_WRONLY | O_CREAT |
+                             (_options.redirect_append[i] ? O_APPEND : O_TRUNC));
+        }
+        break;
+
+      case spawn_options::REDIRECT_STDOUT:
+        if (i != PIPE_STDERR) {
+          throw subprocess_exception(EINVAL, "only standard error can be redirected to standard output");
+        }
+        fds[i] = STDOUT_FILENO;
+        break;
+
+      case spawn_options::REDIRECT_FD:
+        if ((fds[i] = fcntl(_options.redirect_fd[i], F_DUPFD_CLOEXEC, STDERR_FILENO + 1)) < 0) {
+          throw subprocess_exception(errno, "could not duplicate descriptor " +
+                                            std::to_string(_options.redirect_fd[i]));
+        }
+        break;
       }
-
-      /* finally start the new process */
-      execve(_command, _arguments, _environment);
-
-      // TODO if we dup() STDERR_FILENO, we can print this message there
-      //      rather then into the pipe
-      perror((string("could not run command ") + _command).c_str());
     }
-    catch (subprocess_exception & e) {
-      // we do not name stderr explicitly because CRAN doesn't like it
-      ignore_return_value(::write(2, e.what(), strlen(e.what())));
-      exit_on_failure();
+  }
+
+  /* a failed close() must not throw from a destructor */
+  void release ()
+  {
+    for (int & fd : fds) {
+      if (fd > STDERR_FILENO) ::close(fd);
+      fd = HANDLE_CLOSED;
     }
   }
 
-  // child is now running
-  state = RUNNING;
-  termination_mode = _termination_mode;
+  static int open_file (const char * _path, int _flags)
+  {
+    int fd;
+    do {
+      fd = ::open(_path, _flags | O_CLOEXEC, 0666);
+    } while (fd < 0 && errno == EINTR);
 
-  pipe_stdin  = pipes[PIPE_STDIN][pipe_holder::WRITE];
-  pipe_stdout = pipes[PIPE_STDOUT][pipe_holder::READ];
-  pipe_stderr = pipes[PIPE_STDERR][pipe_holder::READ];
+    if (fd < 0) {
+      throw subprocess_exception(errno, string("could not open ") + _path);
+    }
+    return fd;
+  }
+};
 
-  // reset the NONBLOCK on stdout-read and stderr-read descriptors
-  set_non_block(pipe_stdout);
-  set_non_block(pipe_stderr);
 
-  // the very last step: set them to zero so that the destructor
-  // doesn't close them
-  pipes[PIPE_STDIN][pipe_holder::WRITE] = HANDLE_CLOSED;
-  pipes[PIPE_STDOUT][pipe_holder::READ] = HANDLE_CLOSED;
-  pipes[PIPE_STDERR][pipe_holder::READ] = HANDLE_CLOSED;
+/* --- exit notification -------------------------------------------- */
 
-  // update process state
-  wait(TIMEOUT_IMMEDIATE);
+/*
+ * A descriptor which becomes readable when the child exits, or
+ * HANDLE_CLOSED if the kernel does not support pidfd_open() (< 5.3).
+ */
+static int open_pid_fd (pid_t _pid)
+{
+#ifdef SYS_pidfd_open
+  int fd = static_cast<int>(syscall(SYS_pidfd_open, _pid, 0));
+  if (fd >= 0) {
+    return fd;
+  }
+#endif
+  return HANDLE_CLOSED;
 }
 
 
+/*
+ * Without pidfd, SIGCHLD is turned into a byte written into a pipe;
+ * the handler which was installed before is still called. Someone
+ * else might replace the handler later, so whoever waits on the pipe
+ * should wake up periodically.
+ */
+static int sigchld_pipe[2] = { HANDLE_CLOSED, HANDLE_CLOSED };
+static struct sigaction sigchld_previous;
 
-/* --- process_handle::shutdown ------------------------------------- */
+/* milliseconds */
+static const int sigchld_interval = 100;
 
-void process_handle_t::shutdown ()
+
+static void sigchld_handler (int _signal, siginfo_t * _info, void * _context)
 {
-  if (state != RUNNING) {
-    return;
+  int saved = errno;
+  char byte = 0;
+  ignore_return_value(::write(sigchld_pipe[1], &byte, 1));
+  errno = saved;
+
+  if (sigchld_previous.sa_flags & SA_SIGINFO) {
+    if (sigchld_previous.sa_sigaction) {
+      sigchld_previous.sa_sigaction(_signal, _info, _context);
+    }
   }
-  if (!child_id) {
-    throw subprocess_exception(ECHILD, "child does not exist");
+  else if (sigchld_previous.sa_handler != SIG_DFL &&
+           sigchld_previous.sa_handler != SIG_IGN)
+  {
+    sigchld_previous.sa_handler(_signal);
   }
+}
 
-  /* all we need to do is close pipes */
-  auto close_pipe = [](pipe_handle_type _pipe) {
-    if (_pipe != HANDLE_CLOSED) close(_pipe);
-    _pipe = HANDLE_CLOSED;
-  };
 
-  close_pipe(pipe_stdin);
-  close_pipe(pipe_stdout);
-  close_pipe(pipe_stderr);
+/* read end of the pipe; the handler is installed on first use */
+static int sigchld_fd ()
+{
+  if (sigchld_pipe[0] != HANDLE_CLOSED) {
+    return sigchld_pipe[0];
+  }
 
-  /* closing pipes should let the child process exit */
-  // TODO there might be a need to send a termination signal first
-  wait(TIMEOUT_IMMEDIATE);
-  kill();
-  wait(TIMEOUT_INFINITE);
+  if (pipe_cloexec(sigchld_pipe) < 0) {
+    throw subprocess_exception(errno, "could not create a pipe");
+  }
+  for (int fd : sigchld_pipe) {
+    set_non_block(fd);
+  }
 
-  state = SHUTDOWN;
-}
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = sigchld_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset(&action.sa_mask);
 
+  if (sigaction(SIGCHLD, &action, &sigchld_previous) < 0) {
+    throw subprocess_exception(errno, "could not install SIGCHLD handler");
+  }
 
-/* --- process::write ----------------------------------------------- */
+  return sigchld_pipe[0];
+}
 
 
-size_t process_handle_t::write (const void * _buffer, size_t _count)
+static void sigchld_drain ()
 {
-  if (!child_id) {
-    throw subprocess_exception(ECHILD, "child does not exist");
-  }
+  char buffer[256];
+  while (::read(sigchld_pipe[0], buffer, sizeof(buffer)) > 0);
+}
 
-  ssize_t ret = ::write(pipe_stdin, _buffer, _count);
-  if (ret < 0) {
-    throw subprocess_exception(errno, "could not write to child process");
-  }
 
-  return static_cast<size_t>(ret);
-}
+/* --- background reader -------------------------------------------- */
 
+/* wakes up poll_processes(); defined below */
+static void poll_notify ();
 
-/* --- process::read ------------------------------------------------ */
+/**
+ * Drains child's output pipes in a separate thread so that the child
+ * does not block on a full pipe while R is busy.
+ *
+ * The thread never touches memory managed by R: output is collected
+ * in per-pipe queues and handed over to pipe_writer objects in
+ * process_handle_t::read(), in the main thread.
+ */
+struct background_reader {
 
+  struct queue {
+    pipe_handle_type fd;
+    output_tee * tee;
+    pipe_writer::container_type data;
+    bool eof;
 
-struct enable_block_mode {
-  int fd;
+    queue (pipe_handle_type _fd, output_tee * _tee)
+      : fd(_fd), tee(_tee), eof(_fd == HANDLE_CLOSED) { }
+  };
 
-  enable_block_mode (int _fd) : fd (_fd) {
-    set_block(fd);
-  }
+  background_reader (const pipe_writer & _stdout, pipe_handle_type _stdout_fd,
+                     const pipe_writer & _stderr, pipe_handle_type _stderr_fd,
+                     const spawn_options & _options)
+    : queues{ queue(_stdout_fd, _stdout.tee), queue(_stderr_fd, _stderr.tee) },
+      chunk_size(std::max<size_t>(65536, std::max(_stdout.read_size, _stderr.read_size))),
+      wakeup{ HANDLE_CLOSED, HANDLE_CLOSED },
+      limit(_options.buffer_limit), policy(_options.overflow_policy),
+      dropped(0), error(0), stopped(false)
+  {
+    if (pipe_cloexec(wakeup) < 0) {
+      throw subprocess_exception(errno, "could not create a pipe");
+    }
+    set_non_block(wakeup[0]);
+    set_non_block(wakeup[1]);
 
-  ~enable_block_mode () {
-    set_non_block(fd);
+    thread = std::thread(&background_reader::run, this);
   }
-};
 
+  ~background_reader ()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopped = true;
+    }
+    wake();
+    thread.join();
 
-ssize_t timed_read (process_handle_t & _handle, pipe_type _pipe, int _timeout)
-{
-  struct pollfd fds[2];
-  fds[0].fd = -1;
-  fds[1].fd = -1;
+    ::close(wakeup[0]);
+    ::close(wakeup[1]);
+  }
 
-  if (_pipe & PIPE_STDOUT) {
-    fds[0].fd = _handle.pipe_stdout;
-    fds[0].events = POLLIN;
-    _handle.stdout_.clear();
+  /* interrupt poll() in the reader thread */
+  void wake ()
+  {
+    char byte = 0;
+    ignore_return_value(::write(wakeup[1], &byte, 1));
   }
 
-  if (_pipe & PIPE_STDERR) {
-    fds[1].fd = _handle.pipe_stderr;
-    fds[1].events = POLLIN;
-    _handle.stderr_.clear();
+  bool accepts (const queue & _queue) const
+  {
+    return !_queue.eof &&
+      (policy == spawn_options::OVERFLOW_DROP || _queue.data.size() < limit);
   }
 
-  time_t start = clock_millisec(), timediff = _timeout;
-  ssize_t rc;
+  /* body of the reader thread */
+  void run ()
+  {
+    vector<char> chunk(chunk_size);
+
+    while (true) {
+      struct pollfd fds[3];
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopped || (queues[0].eof && queues[1].eof)) break;
+
+        // a full queue is not read from until R takes the data over
+        for (int i = 0; i < 2; ++i) {
+          fds[i].fd = accepts(queues[i]) ? queues[i].fd : -1;
+          fds[i].events = POLLIN;
+          fds[i].revents = 0;
+        }
+      }
+      fds[2].fd = wakeup[0];
+      fds[2].events = POLLIN;
+      fds[2].revents = 0;
+
+      if (poll(fds, 3, -1) < 0) {
+        if (errno == EINTR || errno == EAGAIN) continue;
+        std::lock_guard<std::mutex> lock(mutex);
+        error = errno;
+        break;
+      }
 
-  do {
-    rc = poll(fds, 2, timediff);
-    timediff = _timeout - (clock_millisec() - start);
+      if (fds[2].revents) {
+        while (::read(wakeup[0], chunk.data(), chunk.size()) > 0);
+      }
 
-    // interrupted or kernel failed to allocate internal resources
-    if (rc < 0 && (errno == EINTR || errno == EAGAIN)) {
-      rc = 0;
+      for (int i = 0; i < 2; ++i) {
+        if (fds[i].fd == -1 || !fds[i].revents) continue;
+
+        size_t length = chunk.size();
+        if (policy == spawn_options::OVERFLOW_BLOCK) {
+          std::lock_guard<std::mutex> lock(mutex);
+          length = std::min(length, limit - queues[i].data.size());
+        }
+
+        ssize_t rc = ::read(fds[i].fd, chunk.data(), length);
+        if (rc < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+
+        // the copy is written here, as soon as output arrives
+        if (rc > 0 && queues[i].tee) {
+          queues[i].tee->write(chunk.data(), rc);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (rc < 0) {
+          error = errno;
+          queues[i].eof = true;
+        }
+        else if (rc == 0) {
+          queues[i].eof = true;
+        }
+        else {
+          pipe_writer::container_type & data = queues[i].data;
+          size_t accepted = std::min((size_t)rc, limit - std::min(limit, data.size()));
+          data.insert(data.end(), chunk.data(), chunk.data() + accepted);
+          dropped += rc - accepted;
+        }
+        data_ready.notify_all();
+        poll_notify();
+      }
     }
-  } while (rc == 0 && timediff > 0);
 
-  // nothing to read
-  if (rc == 0) {
-    return 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    queues[0].eof = queues[1].eof = true;
+    data_ready.notify_all();
+    poll_notify();
   }
 
-  // TODO if an error occurs in the first read() it will be lost
-  if (fds[0].fd != -1 && fds[0].revents == POLLIN) {
-    rc = std::min(rc, (ssize_t)_handle.stdout_.read(_handle.pipe_stdout, mbcslocale));
+  /* readiness of queued output, as poll_state flags */
+  unsigned pending ()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned flags = 0;
+    if (!queues[0].data.empty()) flags |= poll_state::STDOUT_DATA;
+    if (!queues[1].data.empty()) flags |= poll_state::STDERR_DATA;
+    if (queues[0].eof) flags |= poll_state::STDOUT_EOF;
+    if (queues[1].eof) flags |= poll_state::STDERR_EOF;
+    return flags;
   }
-  if (fds[1].fd != -1 && fds[1].revents == POLLIN) {
-    rc = std::min(rc, (ssize_t)_handle.stderr_.read(_handle.pipe_stderr, mbcslocale));
+
+  /* is there anything to hand over, or will there never be? */
+  bool ready (pipe_type _pipe) const
+  {
+    bool ended = true;
+    for (int i = 0; i < 2; ++i) {
+      if (!(_pipe & (i ? PIPE_STDERR : PIPE_STDOUT))) continue;
+      if (!queues[i].data.empty()) return true;
+      ended = ended && queues[i].eof;
+    }
+    return ended;
   }
 
-  return rc;
-}
+  /* ready(), called outside of the reader's lock */
+  bool available (pipe_type _pipe)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ready(_pipe);
+  }
 
+  /*
+   * Wait for data and hand it over to pipe writers. No system call is
+   * made if there is data already.
+   */
+  size_t read (process_handle_t & _handle, pipe_type _pipe, int _timeout, bool _verify)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
 
-size_t process_handle_t::read (pipe_type _pipe, int _timeout)
-{
-  if (!child_id) {
-    throw subprocess_exception(ECHILD, "child does not exist");
-  }
+    auto is_ready = [this, _pipe] { return ready(_pipe); };
+    if (_timeout < 0) {
+      data_ready.wait(lock, is_ready);
+    }
+    else if (_timeout > 0) {
+      data_ready.wait_for(lock, std::chrono::milliseconds(_timeout), is_ready);
+    }
 
-  ssize_t rc = timed_read(*this, _pipe, _timeout);
+    if (error) {
+      int code = error;
+      error = 0;
+      throw subprocess_exception(code, "could not read from child process");
+    }
 
-  if (rc < 0) {
-    throw subprocess_exception(errno, "could not read from child process");
-  }
+    size_t rc = 0;
+    bool was_full = false;
+    pipe_writer * writers[2] = { &_handle.stdout_, &_handle.stderr_ };
 
-  return static_cast<size_t>(rc);
-}
+    for (int i = 0; i < 2; ++i) {
+      if (!(_pipe & (i ? PIPE_STDERR : PIPE_STDOUT))) continue;
+      was_full = was_full || (queues[i].data.size() >= limit);
+      rc += writers[i]->append(queues[i].data, _verify);
+      writers[i]->eof = queues[i].eof;
+    }
 
+    _handle.dropped += dropped;
+    dropped = 0;
 
-/* --- process::close_input ----------------------------------------- */
+    // let the reader thread resume reading from a full pipe
+    if (was_full) {
+      wake();
+    }
 
-void process_handle_t::close_input ()
-{
-  if (pipe_stdin == HANDLE_CLOSED) {
-    throw subprocess_exception(EALREADY, "child's standard input already closed");
+    return rc;
   }
 
-  close(pipe_stdin);
-  pipe_stdin = HANDLE_CLOSED;
-}
+  queue queues[2];
 
+  /* a single read takes at most this much, at least one full pipe */
+  size_t chunk_size;
 
-/* --- process::wait ------------------------------------------------ */
+  int wakeup[2];
 
+  size_t limit;
+  spawn_options::overflow_policy_type policy;
 
-void process_handle_t::wait (int _timeout)
-{
-  if (!child_id) {
-    throw subprocess_exception(ECHILD, "child does not exist");
-  }
-  if (state != RUNNING) {
-    return;
-  }
+  /* number of bytes dropped because queues were full */
+  size_t dropped;
+  int error;
+  bool stopped;
 
-  /* to wait or not to wait? */
-  int options = 0;
-  if (_timeout >= 0) {
-    options = WNOHANG;
-  }
+  std::mutex mutex;
+  std::condition_variable data_ready;
+  std::thread thread;
+};
 
-  /* make the actual system call */
-  int start = clock_millisec(), rc;
-  do {
-    rc = waitpid(child_id, &return_code, options);
 
-    // there's been an error (<0)
-    if (rc < 0) {
-      throw subprocess_exception(errno, "waitpid() failed");
+
+/* --- poll_processes ----------------------------------------------- */
+
+/**
+ * State shared by all calls to poll_processes().
+ *
+ * In Linux output pipes are registered with a single epoll instance
+ * the first time a handle is polled, with EPOLLONESHOT: a pipe which
+ * reported data is not reported again until R reads from it. Thus
+ * a wait costs O(ready) system work rather than O(handles). Elsewhere
+ * a single poll() is made over all pipes.
+ *
+ * Background reader threads signal new output via the notify pipe.
+ */
+struct process_poller {
+
+  int notify[2];
+
+#ifdef __linux__
+  int epoll_fd;
+#endif
+
+  /* incremented with every call to poll_processes() */
+  unsigned long round;
+
+  /* the SIGCHLD pipe is watched for children without pidfd */
+  bool sigchld_registered;
+
+  /* see key() */
+  static const uint64_t notify_key = 0, sigchld_key = 1;
+
+  process_poller ()
+    : notify{HANDLE_CLOSED, HANDLE_CLOSED}, round(0), sigchld_registered(false)
+  {
+    if (pipe_cloexec(notify) < 0) {
+      throw subprocess_exception(errno, "could not create a pipe");
+    }
+    for (int fd : notify) {
+      set_non_block(fd);
     }
 
-    _timeout -= clock_millisec() - start;
-  } while (rc == 0 && _timeout > 0);
+#ifdef __linux__
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+      int code = errno;
+      close(notify[0]);
+      close(notify[1]);
+      throw subprocess_exception(code, "could not create epoll instance");
+    }
 
-  // the child is still running
-  if (rc == 0) {
-     return;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = notify_key;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notify[0], &event);
+#endif
+  }
+
+  /* pointer to the handle, low bits: 1 - stdout, 2 - stderr, 3 - exit,
+   * 4 - stdin can take queued input */
+  static const uint64_t key_mask = 7;
+
+  static uint64_t key (process_handle_t & _handle, int _which)
+  {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&_handle)) | _which;
+  }
+
+  void add (process_handle_t & _handle)
+  {
+#ifdef __linux__
+    pipe_handle_type fds[2] = { _handle.pipe_stdout, _handle.pipe_stderr };
+    for (int i = 0; i < 2; ++i) {
+      if (fds[i] == HANDLE_CLOSED) continue;
+
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.u64 = key(_handle, i + 1);
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[i], &event) < 0 && errno != EEXIST) {
+        throw subprocess_exception(errno, "could not register pipe with epoll");
+      }
+    }
+
+    if (_handle.pid_fd != HANDLE_CLOSED) {
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.u64 = key(_handle, 3);
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, _handle.pid_fd, &event) < 0 && errno != EEXIST) {
+        throw subprocess_exception(errno, "could not register pidfd with epoll");
+      }
+    }
+    else if (_handle.state == process_handle_t::RUNNING && !sigchld_registered) {
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.u64 = sigchld_key;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_fd(), &event) < 0) {
+        throw subprocess_exception(errno, "could not register pipe with epoll");
+      }
+      sigchld_registered = true;
+    }
+#endif
+    _handle.polling.registered = true;
+  }
+
+  /* data has been read, wait for more */
+  void rearm (process_handle_t & _handle, pipe_type _pipe)
+  {
+    if (_pipe & PIPE_STDOUT) _handle.polling.flags &= ~poll_state::STDOUT_DATA;
+    if (_pipe & PIPE_STDERR) _handle.polling.flags &= ~poll_state::STDERR_DATA;
+
+#ifdef __linux__
+    pipe_handle_type fds[2] = { _handle.pipe_stdout, _handle.pipe_stderr };
+    for (int i = 0; i < 2; ++i) {
+      if (fds[i] == HANDLE_CLOSED || !(_pipe & (i ? PIPE_STDERR : PIPE_STDOUT))) continue;
+
+      struct epoll_event event;
+      event.events = EPOLLIN | EPOLLONESHOT;
+      event.data.u64 = key(_handle, i + 1);
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fds[i], &event) < 0) {
+        throw subprocess_exception(errno, "could not register pipe with epoll");
+      }
+    }
+#endif
+  }
+
+  /* wait until the child can take queued input */
+  void watch_input (process_handle_t & _handle)
+  {
+#ifdef __linux__
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.u64 = key(_handle, 4);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, _handle.pipe_stdin, &event) < 0 &&
+        (errno != ENOENT || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, _handle.pipe_stdin, &event) < 0))
+    {
+      throw subprocess_exception(errno, "could not register pipe with epoll");
+    }
+#endif
+    _handle.polling.registered = true;
+  }
+
+  /* must be called before pipes are closed or the handle is freed */
+  void remove (process_handle_t & _handle)
+  {
+#ifdef __linux__
+    forget(_handle.pipe_stdin);
+    forget(_handle.pipe_stdout);
+    forget(_handle.pipe_stderr);
+    forget(_handle.pid_fd);
+#endif
+    _handle.polling.registered = false;
+  }
+
+  /* must be called before a registered descriptor is closed */
+  void forget (int _fd)
+  {
+#ifdef __linux__
+    if (_fd != HANDLE_CLOSED) {
+      struct epoll_event event;
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, _fd, &event);
+    }
+#endif
+  }
+
+  void drain_notify ()
+  {
+    char buffer[256];
+    while (::read(notify[0], buffer, sizeof(buffer)) > 0);
+  }
+};
+
+
+/* the write end of the notify pipe, once the poller exists */
+static std::atomic<int> poll_notify_fd(HANDLE_CLOSED);
+
+
+/* never destroyed: reader threads might still notify at exit */
+static process_poller & poller ()
+{
+  static process_poller * instance = new process_poller();
+  poll_notify_fd.store(instance->notify[1]);
+  return *instance;
+}
+
+
+static void poll_notify ()
+{
+  int fd = poll_notify_fd.load();
+  if (fd != HANDLE_CLOSED) {
+    char byte = 0;
+    ignore_return_value(::write(fd, &byte, 1));
+  }
+}
+
+
+/* milliseconds */
+static const int exit_check_interval = 10;
+
+/* how often a background reader is checked while input is fed */
+static const int input_check_interval = 10;
+
+
+static int write_input (process_handle_t & _handle);
+
+
+size_t poll_processes (process_handle_t * const * _handles, size_t _count,
+                       int _timeout, size_t * _ready)
+{
+  process_poller & shared = poller();
+  unsigned long round = ++shared.round;
+
+  size_t count = 0;
+  vector<char> reported(_count, 0);
+  vector<process_handle_t *> readers, exiting, unwatched;
+
+  // report a handle if it is part of this call and is ready
+  auto mark = [&] (process_handle_t & _handle) {
+    poll_state & polling = _handle.polling;
+    if (polling.round != round || reported[polling.index] == 1) return;
+
+    // a child which closed its output has exited or is about to
+    bool eof = polling.eof() && !polling.eof_reported;
+    if (polling.eof()) {
+      _handle.wait(TIMEOUT_IMMEDIATE);
+    }
+
+    if (polling.data() || eof || _handle.state != process_handle_t::RUNNING) {
+      polling.eof_reported = polling.eof();
+      reported[polling.index] = 1;
+      _ready[count++] = polling.index;
+    }
+    else if (polling.eof() && _handle.pid_fd == HANDLE_CLOSED && !reported[polling.index]) {
+      reported[polling.index] = 2;
+      exiting.push_back(&_handle);
+    }
+  };
+
+  auto update = [&] (process_handle_t & _handle, int _which, bool _data, bool _hup) {
+    unsigned data = (_which == 1) ? poll_state::STDOUT_DATA : poll_state::STDERR_DATA;
+    unsigned eof  = (_which == 1) ? poll_state::STDOUT_EOF : poll_state::STDERR_EOF;
+    if (_data) _handle.polling.flags |= data;
+    if (_hup) _handle.polling.flags |= eof;
+    mark(_handle);
+  };
+
+  for (size_t i = 0; i < _count; ++i) {
+    process_handle_t & handle = *_handles[i];
+    if (handle.polling.round == round) continue;   // listed twice
+
+    handle.polling.round = round;
+    handle.polling.index = i;
+
+    if (handle.reader) {
+      handle.polling.flags = handle.reader->pending();
+      readers.push_back(&handle);
+    }
+    else if (!handle.polling.registered) {
+      shared.add(handle);
+    }
+
+    // without pidfd exit is noticed via SIGCHLD
+    if (handle.pid_fd == HANDLE_CLOSED && handle.state == process_handle_t::RUNNING) {
+      unwatched.push_back(&handle);
+    }
+
+    // queued input is written while waiting
+    write_input(handle);
+#ifdef __linux__
+    if (handle.stdin_.size()) {
+      shared.watch_input(handle);
+    }
+#endif
+
+    mark(handle);
+  }
+
+  int timeout = count ? TIMEOUT_IMMEDIATE : _timeout;
+  time_t start = clock_millisec();
+
+  while (true) {
+    bool notified = false, exited = false, more = false;
+
+    // exit of a child which closed its output is checked periodically
+    int slice = timeout;
+    if (!exiting.empty() && (timeout < 0 || timeout > exit_check_interval)) {
+      slice = exit_check_interval;
+    }
+
+#ifdef __linux__
+    const int max_events = 256;
+    struct epoll_event events[max_events];
+
+    int rc = epoll_wait(shared.epoll_fd, events, max_events, slice);
+    if (rc < 0) {
+      if (errno != EINTR) {
+        throw subprocess_exception(errno, "epoll_wait() failed");
+      }
+      rc = 0;
+    }
+
+    for (int i = 0; i < rc; ++i) {
+      uint64_t key = events[i].data.u64;
+      if (key == process_poller::notify_key) {
+        notified = true;
+        continue;
+      }
+      if (key == process_poller::sigchld_key) {
+        exited = true;
+        continue;
+      }
+
+      process_handle_t & handle = *reinterpret_cast<process_handle_t *>(
+        static_cast<uintptr_t>(key & ~process_poller::key_mask));
+      int which = static_cast<int>(key & process_poller::key_mask);
+
+      if (which == 4) {
+        write_input(handle);
+        if (handle.stdin_.size()) {
+          shared.watch_input(handle);
+        }
+      }
+      else if (which == 3) {
+        handle.wait(TIMEOUT_IMMEDIATE);
+        mark(handle);
+      }
+      else {
+        update(handle, which, events[i].events & EPOLLIN,
+               events[i].events & (EPOLLHUP | EPOLLERR));
+      }
+    }
+
+    // collect the remaining events without waiting
+    more = (rc == max_events);
+#else
+    vector<struct pollfd> fds;
+    vector<std::pair<process_handle_t *, int> > owners;
+
+    for (size_t i = 0; i < _count; ++i) {
+      process_handle_t & handle = *_handles[i];
+      if (handle.polling.index != i) continue;
+
+      if (handle.stdin_.size()) {
+        struct pollfd fd = { handle.pipe_stdin, POLLOUT, 0 };
+        fds.push_back(fd);
+        owners.push_back(std::make_pair(&handle, 4));
+      }
+      if (handle.reader) continue;
+
+      // emulate EPOLLONESHOT: pipes already reported are skipped
+      pipe_handle_type pipes[2] = { handle.pipe_stdout, handle.pipe_stderr };
+      unsigned skip[2] = { poll_state::STDOUT_DATA | poll_state::STDOUT_EOF,
+                           poll_state::STDERR_DATA | poll_state::STDERR_EOF };
+      for (int j = 0; j < 2; ++j) {
+        if (pipes[j] == HANDLE_CLOSED || (handle.polling.flags & skip[j])) continue;
+        struct pollfd fd = { pipes[j], POLLIN, 0 };
+        fds.push_back(fd);
+        owners.push_back(std::make_pair(&handle, j + 1));
+      }
+    }
+
+    if (!unwatched.empty()) {
+      struct pollfd fd = { sigchld_fd(), POLLIN, 0 };
+      fds.push_back(fd);
+    }
+
+    struct pollfd fd = { shared.notify[0], POLLIN, 0 };
+    fds.push_back(fd);
+
+    int rc = poll(fds.data(), fds.size(), slice);
+    if (rc < 0) {
+      if (errno != EINTR && errno != EAGAIN) {
+        throw subprocess_exception(errno, "poll() failed");
+      }
+      rc = 0;
+    }
+
+    for (size_t i = 0; rc > 0 && i < owners.size(); ++i) {
+      if (!fds[i].revents) continue;
+      if (owners[i].second == 4) {
+        write_input(*owners[i].first);
+        continue;
+      }
+      update(*owners[i].first, owners[i].second, fds[i].revents & POLLIN,
+             fds[i].revents & (POLLHUP | POLLERR | POLLNVAL));
+    }
+    notified = rc > 0 && fds.back().revents;
+    exited = rc > 0 && !unwatched.empty() && fds[owners.size()].revents;
+#endif
+
+    if (exited) {
+      sigchld_drain();
+      for (process_handle_t * handle : unwatched) {
+        handle->wait(TIMEOUT_IMMEDIATE);
+        mark(*handle);
+      }
+    }
+
+    if (notified) {
+      shared.drain_notify();
+      for (process_handle_t * handle : readers) {
+        handle->polling.flags = handle->reader->pending();
+        mark(*handle);
+      }
+    }
+
+    for (process_handle_t * handle : exiting) {
+      mark(*handle);
+    }
+
+    if (more) {
+      timeout = TIMEOUT_IMMEDIATE;
+      continue;
+    }
+    if (count || timeout == TIMEOUT_IMMEDIATE) {
+      break;
+    }
+    if (_timeout > 0) {
+      timeout = _timeout - static_cast<int>(clock_millisec() - start);
+      if (timeout <= 0) break;
+    }
+  }
+
+  return count;
+}
+
+
+void process_handle_t::stop_polling ()
+{
+  if (polling.registered) {
+    poller().remove(*this);
+  }
+}
+
+
+/* --- event_watcher ------------------------------------------------ */
+
+#ifdef __linux__
+
+struct event_watcher::state {
+
+  struct entry {
+    /* PIPE_STDOUT and/or PIPE_STDERR registered with epoll */
+    int pipes;
+    bool exit;
+    /* duplicate of the pidfd; HANDLE_CLOSED if exit is noticed
+     * through SIGCHLD */
+    int exit_fd;
+
+    entry () : pipes(0), exit(false), exit_fd(HANDLE_CLOSED) { }
+  };
+
+  int epoll_fd;
+  int notify[2];
+
+  /* the SIGCHLD pipe is watched for children without pidfd */
+  bool sigchld_registered;
+
+  std::map<process_handle_t *, entry> entries;
+
+  /* children already gone when their exit was to be watched */
+  vector<process_handle_t *> gone;
+
+  /* pointer to the handle, low bits: 1 - stdout, 2 - stderr, 3 - exit */
+  static const uint64_t notify_key = 0, sigchld_key = 1, key_mask = 7;
+
+  static uint64_t key (process_handle_t & _handle, int _which)
+  {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&_handle)) | _which;
+  }
+
+  state ()
+    : notify{HANDLE_CLOSED, HANDLE_CLOSED}, sigchld_registered(false)
+  {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+      throw subprocess_exception(errno, "could not create epoll instance");
+    }
+    if (pipe_cloexec(notify) < 0) {
+      int code = errno;
+      close(epoll_fd);
+      throw subprocess_exception(code, "could not create a pipe");
+    }
+    for (int fd : notify) {
+      set_non_block(fd);
+    }
+    add(notify[0], notify_key);
+  }
+
+  ~state ()
+  {
+    for (auto & item : entries) {
+      if (item.second.exit_fd != HANDLE_CLOSED) close(item.second.exit_fd);
+    }
+    close(notify[0]);
+    close(notify[1]);
+    close(epoll_fd);
+  }
+
+  void add (int _fd, uint64_t _key)
+  {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = _key;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, _fd, &event) < 0 && errno != EEXIST) {
+      throw subprocess_exception(errno, "could not register descriptor with epoll");
+    }
+  }
+
+  void remove (int _fd)
+  {
+    struct epoll_event event;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, _fd, &event);
+  }
+
+  void forget_exit (process_handle_t * _handle, entry & _entry)
+  {
+    if (_entry.exit_fd != HANDLE_CLOSED) {
+      remove(_entry.exit_fd);
+      close(_entry.exit_fd);
+      _entry.exit_fd = HANDLE_CLOSED;
+    }
+    _entry.exit = false;
+    gone.erase(std::remove(gone.begin(), gone.end(), _handle), gone.end());
+  }
+
+  /* a child reaped by someone else is gone all the same */
+  static bool reap (process_handle_t & _handle)
+  {
+    try {
+      _handle.wait(TIMEOUT_IMMEDIATE);
+    }
+    catch (subprocess_exception &) {
+      return true;
+    }
+    return _handle.state != process_handle_t::RUNNING;
+  }
+
+  void report_gone (process_handle_t & _handle)
+  {
+    gone.push_back(&_handle);
+    char byte = 0;
+    ignore_return_value(::write(notify[1], &byte, 1));
+  }
+};
+
+
+event_watcher::event_watcher () : impl(new state()) { }
+
+
+event_watcher::~event_watcher ()
+{
+  delete impl;
+}
+
+
+int event_watcher::fd () const
+{
+  return impl->epoll_fd;
+}
+
+
+void event_watcher::watch_output (process_handle_t & _handle, pipe_type _pipes)
+{
+  state::entry & entry = impl->entries[&_handle];
+
+  pipe_handle_type fds[2]   = { _handle.pipe_stdout, _handle.pipe_stderr };
+  const pipe_writer * writers[2] = { &_handle.stdout_, &_handle.stderr_ };
+  for (int i = 0; i < 2; ++i) {
+    int which = i + 1;
+    if (!(_pipes & which) || (entry.pipes & which)) continue;
+    if (fds[i] == HANDLE_CLOSED || writers[i]->eof) continue;
+
+    impl->add(fds[i], state::key(_handle, which));
+    entry.pipes |= which;
+  }
+
+  if (!entry.pipes && !entry.exit) {
+    impl->entries.erase(&_handle);
+  }
+}
+
+
+void event_watcher::watch_exit (process_handle_t & _handle)
+{
+  state::entry & entry = impl->entries[&_handle];
+  if (entry.exit) return;
+  entry.exit = true;
+
+  if (_handle.state != process_handle_t::RUNNING) {
+    impl->report_gone(_handle);
+    return;
+  }
+
+  // the handle closes its pidfd when it reaps the child
+  if (_handle.pid_fd != HANDLE_CLOSED) {
+    entry.exit_fd = fcntl(_handle.pid_fd, F_DUPFD_CLOEXEC, 0);
+  }
+  if (entry.exit_fd != HANDLE_CLOSED) {
+    impl->add(entry.exit_fd, state::key(_handle, 3));
+    return;
+  }
+
+  if (!impl->sigchld_registered) {
+    impl->add(sigchld_fd(), state::sigchld_key);
+    impl->sigchld_registered = true;
+  }
+  // the signal might have come before it was watched
+  if (state::reap(_handle)) {
+    impl->report_gone(_handle);
+  }
+}
+
+
+void event_watcher::forget (process_handle_t & _handle, pipe_type _pipes, bool _exit)
+{
+  auto it = impl->entries.find(&_handle);
+  if (it == impl->entries.end()) return;
+  state::entry & entry = it->second;
+
+  pipe_handle_type fds[2] = { _handle.pipe_stdout, _handle.pipe_stderr };
+  for (int i = 0; i < 2; ++i) {
+    int which = i + 1;
+    if (!(_pipes & which) || !(entry.pipes & which)) continue;
+    impl->remove(fds[i]);
+    entry.pipes &= ~which;
+  }
+
+  if (_exit && entry.exit) {
+    impl->forget_exit(&_handle, entry);
+  }
+
+  if (!entry.pipes && !entry.exit) {
+    impl->entries.erase(it);
+  }
+}
+
+
+void event_watcher::ready (vector<event> & _events)
+{
+  _events.clear();
+
+  auto find = [&] (process_handle_t * _handle) -> event & {
+    for (event & ev : _events) {
+      if (ev.handle == _handle) return ev;
+    }
+    event ev = { _handle, 0, false };
+    _events.push_back(ev);
+    return _events.back();
+  };
+
+  auto exited = [&] (process_handle_t * _handle, state::entry & _entry) {
+    impl->forget_exit(_handle, _entry);
+    find(_handle).exited = true;
+  };
+
+  const int max_events = 256;
+  struct epoll_event events[max_events];
+  bool notified = false, sigchld = false;
+
+  int rc = epoll_wait(impl->epoll_fd, events, max_events, 0);
+  if (rc < 0) {
+    if (errno != EINTR) {
+      throw subprocess_exception(errno, "epoll_wait() failed");
+    }
+    rc = 0;
+  }
+
+  for (int i = 0; i < rc; ++i) {
+    uint64_t key = events[i].data.u64;
+    if (key == state::notify_key) {
+      notified = true;
+      continue;
+    }
+    if (key == state::sigchld_key) {
+      sigchld = true;
+      continue;
+    }
+
+    process_handle_t * handle = reinterpret_cast<process_handle_t *>(
+      static_cast<uintptr_t>(key & ~state::key_mask));
+    int which = static_cast<int>(key & state::key_mask);
+
+    auto it = impl->entries.find(handle);
+    if (it == impl->entries.end()) continue;
+
+    if (which == 3) {
+      state::reap(*handle);
+      exited(handle, it->second);
+    }
+    else {
+      find(handle).pipes |= which;
+    }
+  }
+
+  if (notified) {
+    char buffer[256];
+    while (::read(impl->notify[0], buffer, sizeof(buffer)) > 0);
+
+    vector<process_handle_t *> gone;
+    gone.swap(impl->gone);
+    for (process_handle_t * handle : gone) {
+      exited(handle, impl->entries[handle]);
+    }
+  }
+
+  // drained before waitpid() so that no exit goes unnoticed
+  if (sigchld) {
+    sigchld_drain();
+    for (auto & item : impl->entries) {
+      state::entry & entry = item.second;
+      if (!entry.exit || entry.exit_fd != HANDLE_CLOSED) continue;
+      if (state::reap(*item.first)) {
+        exited(item.first, entry);
+      }
+    }
+  }
+
+  for (auto it = impl->entries.begin(); it != impl->entries.end(); ) {
+    if (!it->second.pipes && !it->second.exit) {
+      it = impl->entries.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+}
+
+#else /* __linux__ */
+
+event_watcher::event_watcher () : impl(nullptr)
+{
+  throw subprocess_exception(ENOTSUP, "watching children from the event loop is supported only in Linux");
+}
+
+event_watcher::~event_watcher () { }
+
+int event_watcher::fd () const { return HANDLE_CLOSED; }
+
+void event_watcher::watch_output (process_handle_t & _handle, pipe_type _pipes) { }
+
+void event_watcher::watch_exit (process_handle_t & _handle) { }
+
+void event_watcher::forget (process_handle_t & _handle, pipe_type _pipes, bool _exit) { }
+
+void event_watcher::ready (vector<event> & _events) { _events.clear(); }
+
+#endif /* __linux__ */
+
+
+/* --- posix_spawn ------------------------------------------------- */
+
+/*
+ * posix_spawn() does not copy parent's page tables (glibc creates the
+ * child with CLONE_VM | CLONE_VFORK), which matters when R holds
+ * gigabytes of data. It can be used if all the steps which follow
+ * fork() in the child can be expressed as spawn attributes and file
+ * actions.
+ */
+static bool can_posix_spawn (const char * _workdir,
+                             process_handle_t::termination_mode_type _termination_mode,
+                             const vector<int> & _keep_fds)
+{
+#if defined(SUBPROCESS_SPAWN_CLOSEFROM) || defined(POSIX_SPAWN_CLOEXEC_DEFAULT)
+  const bool can_close_fds = true;
+#else
+  const bool can_close_fds = false;
+#endif
+#ifdef SUBPROCESS_SPAWN_CHDIR
+  const bool can_chdir = true;
+#else
+  const bool can_chdir = false;
+#endif
+#ifdef POSIX_SPAWN_SETSID
+  const bool can_setsid = true;
+#else
+  const bool can_setsid = false;
+#endif
+
+  /* kept descriptors may have FD_CLOEXEC set; only fork() clears it */
+  if (!_keep_fds.empty() || !can_close_fds) return false;
+  if (_workdir != NULL && !can_chdir) return false;
+  if (_termination_mode == process_handle_t::TERMINATION_GROUP && !can_setsid) return false;
+  return true;
+}
+
+
+/* posix_spawn*() functions return error codes rather than set errno */
+static void spawn_check (int _rc, const string & _message)
+{
+  if (_rc != 0) {
+    throw subprocess_exception(_rc, _message);
+  }
+}
+
+
+struct spawn_file_actions {
+  posix_spawn_file_actions_t actions;
+
+  spawn_file_actions () {
+    spawn_check(posix_spawn_file_actions_init(&actions), "could not initialize spawn file actions");
+  }
+
+  ~spawn_file_actions () {
+    posix_spawn_file_actions_destroy(&actions);
+  }
+};
+
+
+struct spawn_attributes {
+  posix_spawnattr_t attributes;
+
+  spawn_attributes () {
+    spawn_check(posix_spawnattr_init(&attributes), "could not initialize spawn attributes");
+  }
+
+  ~spawn_attributes () {
+    posix_spawnattr_destroy(&attributes);
+  }
+};
+
+
+/*
+ * Does what the child does after fork() in process_handle_t::spawn().
+ * Unlike there, a failure to change directory or to run the command
+ * is reported to the parent.
+ */
+static pid_t posix_spawn_child (const char * _command, char *const _arguments[],
+                                char *const _environment[], const char * _workdir,
+                                process_handle_t::termination_mode_type _termination_mode,
+                                const int _streams[3], pipe_holder _pipes[3])
+{
+  spawn_file_actions file_actions;
+  spawn_attributes spawn_attr;
+  posix_spawn_file_actions_t * actions = &file_actions.actions;
+
+  spawn_check(posix_spawn_file_actions_adddup2(actions, _streams[PIPE_STDIN], STDIN_FILENO),
+              "could not set up standard input");
+  spawn_check(posix_spawn_file_actions_adddup2(actions, _streams[PIPE_STDOUT], STDOUT_FILENO),
+              "could not set up standard output");
+  spawn_check(posix_spawn_file_actions_adddup2(actions, _streams[PIPE_STDERR], STDERR_FILENO),
+              "could not set up standard error output");
+
+  for (int i = 0; i < 3; ++i) {
+    for (int fd : _pipes[i].fds) {
+      if (fd == HANDLE_CLOSED) continue;
+      spawn_check(posix_spawn_file_actions_addclose(actions, fd), "could not set up pipes");
+    }
+  }
+
+  /* do not let the child inherit anything else R has open */
+#ifdef SUBPROCESS_SPAWN_CLOSEFROM
+  spawn_check(posix_spawn_file_actions_addclosefrom_np(actions, 3),
+              "could not set up descriptors");
+#endif
+
+#ifdef SUBPROCESS_SPAWN_CHDIR
+  if (_workdir != NULL) {
+    spawn_check(posix_spawn_file_actions_addchdir_np(actions, _workdir),
+                string("could not change working directory to ") + _workdir);
+  }
+#endif
+
+  short flags = 0;
+#ifdef POSIX_SPAWN_SETSID
+  if (_termination_mode == process_handle_t::TERMINATION_GROUP) {
+    flags |= POSIX_SPAWN_SETSID;
+  }
+#endif
+#ifdef POSIX_SPAWN_CLOEXEC_DEFAULT
+  /* MacOS: only descriptors named in file actions are inherited */
+  flags |= POSIX_SPAWN_CLOEXEC_DEFAULT;
+#endif
+  if (flags) {
+    spawn_check(posix_spawnattr_setflags(&spawn_attr.attributes, flags),
+                "could not set spawn attributes");
+  }
+
+  /* if environment is empty, use parent's environment */
+  if (!_environment) {
+    _environment = environ;
+  }
+
+  pid_t pid;
+  spawn_check(posix_spawn(&pid, _command, actions, &spawn_attr.attributes, _arguments, _environment),
+              string("could not run command ") + _command);
+
+  return pid;
+}
+
+
+
+/* ------------------------------------------------------------------ */
+
+/**
+ * Create the child with fork() or posix_spawn() and connect its
+ * standard streams to new pipes or to redirected descriptors.
+ *
+ * @param _pipes Receives parent's ends of stdin, stdout and stderr;
+ *        HANDLE_CLOSED for redirected streams.
+ */
+static pid_t spawn_child (const char * _command, char *const _arguments[],
+                          char *const _environment[], const char * _workdir,
+                          process_handle_t::termination_mode_type _termination_mode,
+                          const vector<int> & _keep_fds, bool _use_posix_spawn,
+                          const redirection_holder & _redirection,
+                          pipe_handle_type _pipes[3])
+{
+  // can be addressed with PIPE_STDIN, PIPE_STDOUT, PIPE_STDERR
+  pipe_holder pipes[3];
+  int streams[3];
+  pid_t child_id;
+
+  for (int i = 0; i < 3; ++i) {
+    if (_redirection.piped(i)) {
+      pipes[i].open();
+      streams[i] = pipes[i][i == PIPE_STDIN ? pipe_holder::READ : pipe_holder::WRITE];
+    }
+    else {
+      streams[i] = _redirection.fds[i];
+    }
+  }
+
+  /* spawn a child */
+  if (_use_posix_spawn) {
+    child_id = posix_spawn_child(_command, _arguments, _environment, _workdir,
+                                 _termination_mode, streams, pipes);
+  }
+  else if ( (child_id = fork()) < 0) {
+    throw subprocess_exception(errno, "could not spawn a process");
+  }
+
+  /* child should copy his ends of pipes and close his and parent's
+   * ends of pipes */
+  if (child_id == 0) {
+    try {
+      dup2(streams[PIPE_STDIN], STDIN_FILENO);
+      dup2(streams[PIPE_STDOUT], STDOUT_FILENO);
+      dup2(streams[PIPE_STDERR], STDERR_FILENO);
+
+      /* pipes and whatever else R has open, but kept descriptors */
+      close_descriptors(_keep_fds.data(), _keep_fds.size());
+      for (int fd : _keep_fds) {
+        fcntl(fd, F_SETFD, 0);
+      }
+
+      /* change directory */
+      if (_workdir != NULL) {
+        chdir(_workdir);
+      }
+
+      /* if termination mode is "group" start new session */
+      if (_termination_mode == process_handle_t::TERMINATION_GROUP) {
+        setsid();
+      }
+
+      /* if environment is empty, use parent's environment */
+      if (!_environment) {
+        _environment = environ;
+      }
+
+      /* finally start the new process */
+      execve(_command, _arguments, _environment);
+
+      // TODO if we dup() STDERR_FILENO, we can print this message there
+      //      rather then into the pipe
+      perror((string("could not run command ") + _command).c_str());
+      exit_on_failure();
+    }
+    catch (subprocess_exception & e) {
+      // we do not name stderr explicitly because CRAN doesn't like it
+      ignore_return_value(::write(2, e.what(), strlen(e.what())));
+      exit_on_failure();
+    }
+  }
+
+  _pipes[PIPE_STDIN]  = pipes[PIPE_STDIN][pipe_holder::WRITE];
+  _pipes[PIPE_STDOUT] = pipes[PIPE_STDOUT][pipe_holder::READ];
+  _pipes[PIPE_STDERR] = pipes[PIPE_STDERR][pipe_holder::READ];
+
+  // the very last step: set them to zero so that the destructor
+  // doesn't close them
+  pipes[PIPE_STDIN][pipe_holder::WRITE] = HANDLE_CLOSED;
+  pipes[PIPE_STDOUT][pipe_holder::READ] = HANDLE_CLOSED;
+  pipes[PIPE_STDERR][pipe_holder::READ] = HANDLE_CLOSED;
+
+  return child_id;
+}
+
+
+/**
+ * In most cases, when a negative value is returned the calling function
+ * can consult the value of errno.
+ *
+ * @return 0 on success and negative on an error.
+ */
+void process_handle_t::spawn (const char * _command, char *const _arguments[],
+	               char *const _environment[], const char * _workdir,
+                 termination_mode_type _termination_mode,
+                 const spawn_options & _options)
+{
+  if (state != NOT_STARTED) {
+    throw subprocess_exception(EALREADY, "process already started");
+  }
+
+  vector<int> keep_fds(_options.keep_fds, _options.keep_fds + _options.keep_fds_count);
+  std::sort(keep_fds.begin(), keep_fds.end());
+  keep_fds.erase(std::unique(keep_fds.begin(), keep_fds.end()), keep_fds.end());
+  for (int fd : keep_fds) {
+    if (fcntl(fd, F_GETFD) < 0) {
+      throw subprocess_exception(errno, "descriptor " + std::to_string(fd) + " cannot be kept");
+    }
+  }
+
+  bool use_posix_spawn = can_posix_spawn(_workdir, _termination_mode, keep_fds);
+  if (_options.engine == spawn_options::ENGINE_FORK) {
+    use_posix_spawn = false;
+  }
+  else if (_options.engine == spawn_options::ENGINE_POSIX_SPAWN && !use_posix_spawn) {
+    throw subprocess_exception(ENOTSUP, "posix_spawn() cannot change working directory, "
+                                        "start a new session or keep descriptors in this system");
+  }
+  if (_options.engine == spawn_options::ENGINE_FORK_SERVER && !keep_fds.empty()) {
+    throw subprocess_exception(ENOTSUP, "fork server cannot pass R's descriptors to the child");
+  }
+
+  // files are opened here so that errors are reported the same way
+  // whichever engine creates the child
+  redirection_holder redirection(_options);
+  open_tees(_options);
+  pipe_handle_type pipes[3];
+  child_id = 0;
+
+  // the fork server is used whenever it is running; if it fails to
+  // create the child, the child is created here
+  bool use_server = (_options.engine == spawn_options::ENGINE_FORK_SERVER) ||
+                    (_options.engine == spawn_options::ENGINE_AUTO && keep_fds.empty() &&
+                     fork_server_running());
+  if (use_server) {
+    child_id = fork_server_spawn(_command, _arguments, _environment, _workdir,
+                                 _termination_mode, redirection.fds, pipes);
+    if (child_id < 0) {
+      if (_options.engine == spawn_options::ENGINE_FORK_SERVER) {
+        throw subprocess_exception(errno, "could not spawn a process via fork server");
+      }
+      child_id = 0;
+    }
+  }
+
+  if (!child_id) {
+    child_id = spawn_child(_command, _arguments, _environment, _workdir,
+                           _termination_mode, keep_fds, use_posix_spawn, redirection, pipes);
+  }
+
+  // child is now running
+  state = RUNNING;
+  termination_mode = _termination_mode;
+
+  // exit is signalled via a descriptor if kernel supports it
+  pid_fd = open_pid_fd(child_id);
+
+  // pipes created by the caller are taken over only now
+  for (int i = 0; i < 3; ++i) {
+    if (_options.redirect[i] == spawn_options::REDIRECT_FD) pipes[i] = _options.redirect_peer[i];
+  }
+
+  pipe_stdin  = pipes[PIPE_STDIN];
+  pipe_stdout = pipes[PIPE_STDOUT];
+  pipe_stderr = pipes[PIPE_STDERR];
+
+  // resized here, whichever engine created the pipes; reads are sized
+  // to drain a full pipe at once
+  for (int i = 0; i < 3; ++i) {
+    pipe_capacity[i] = (pipes[i] == HANDLE_CLOSED) ? 0 : set_pipe_size(pipes[i], _options.pipe_size[i]);
+  }
+  stdout_.read_size = std::max(pipe_writer::buffer_size, pipe_capacity[PIPE_STDOUT]);
+  stderr_.read_size = std::max(pipe_writer::buffer_size, pipe_capacity[PIPE_STDERR]);
+
+  // all pipes are non-blocking; input which does not fit is queued
+  for (pipe_handle_type pipe : pipes) {
+    if (pipe != HANDLE_CLOSED) set_non_block(pipe);
+  }
+#ifdef F_SETNOSIGPIPE
+  if (pipe_stdin != HANDLE_CLOSED) fcntl(pipe_stdin, F_SETNOSIGPIPE, 1);
+#endif
+
+  // redirected output never reaches R
+  if (pipe_stdout == HANDLE_CLOSED) {
+    stdout_.eof = true;
+    polling.flags |= poll_state::STDOUT_EOF;
+  }
+  if (pipe_stderr == HANDLE_CLOSED) {
+    stderr_.eof = true;
+    polling.flags |= poll_state::STDERR_EOF;
+  }
+
+  // from now on output is drained in a separate thread
+  if (_options.background_reader) {
+    reader = new background_reader(stdout_, pipe_stdout, stderr_, pipe_stderr, _options);
+  }
+
+  // update process state
+  wait(TIMEOUT_IMMEDIATE);
+}
+
+
+
+/* --- spawn_pipeline ----------------------------------------------- */
+
+void spawn_pipeline (process_handle_t * const * _handles, size_t _count,
+                     const char * const * _commands, char ** const * _arguments,
+                     char *const _environment[], const char * _workdir,
+                     process_handle_t::termination_mode_type _termination_mode,
+                     const spawn_options & _options)
+{
+  if (!_count) return;
+
+  // ends of the pipeline are opened once and shared by all children,
+  // so that e.g. a log of stderr is not truncated by each of them
+  redirection_holder ends(_options);
+  pipe_holder pipes[3];
+  int child_end[3], parent_end[3];
+
+  for (int i = 0; i < 3; ++i) {
+    child_end[i] = ends.fds[i];
+    parent_end[i] = HANDLE_CLOSED;
+    if (!ends.piped(i)) continue;
+
+    pipe_holder::pipe_end child_side = (i == PIPE_STDIN ? pipe_holder::READ : pipe_holder::WRITE);
+    pipes[i].open();
+    child_end[i] = pipes[i][child_side];
+    parent_end[i] = pipes[i][child_side == pipe_holder::READ ? pipe_holder::WRITE : pipe_holder::READ];
+  }
+  if (_options.redirect[PIPE_STDERR] == spawn_options::REDIRECT_STDOUT) {
+    child_end[PIPE_STDERR] = child_end[PIPE_STDOUT];
+  }
+
+  size_t i = 0;
+  try {
+    pipe_holder link;
+    for (; i < _count; ++i) {
+      bool first = (i == 0), last = (i == _count - 1);
+
+      // stdin is the read end of the previous link
+      pipe_holder previous;
+      std::swap(previous.fds, link.fds);
+      if (!last) {
+        link.open();
+        set_pipe_size(link[pipe_holder::READ], _options.pipe_size[PIPE_STDOUT]);
+      }
+
+      spawn_options options = _options;
+      std::fill(options.redirect, options.redirect + 3, spawn_options::REDIRECT_FD);
+      std::fill(options.redirect_peer, options.redirect_peer + 3, HANDLE_CLOSED);
+
+      options.redirect_fd[PIPE_STDIN]  = first ? child_end[PIPE_STDIN] : previous[pipe_holder::READ];
+      options.redirect_fd[PIPE_STDOUT] = last ? child_end[PIPE_STDOUT] : link[pipe_holder::WRITE];
+      options.redirect_fd[PIPE_STDERR] = child_end[PIPE_STDERR];
+      if (first) options.redirect_peer[PIPE_STDIN] = parent_end[PIPE_STDIN];
+      if (last) {
+        options.redirect_peer[PIPE_STDOUT] = parent_end[PIPE_STDOUT];
+        options.redirect_peer[PIPE_STDERR] = parent_end[PIPE_STDERR];
+      }
+      else {
+        // nothing to read in the middle of the pipeline
+        options.background_reader = false;
+        std::fill(options.tee_path, options.tee_path + 3, nullptr);
+      }
+
+      _handles[i]->spawn(_commands[i], _arguments[i], _environment, _workdir,
+                         _termination_mode, options);
+
+      // parent ends now belong to the handle
+      for (int j = 0; j < 3; ++j) {
+        if (options.redirect_peer[j] == HANDLE_CLOSED) continue;
+        for (int & fd : pipes[j].fds) {
+          if (fd == options.redirect_peer[j]) fd = HANDLE_CLOSED;
+        }
+      }
+    }
+  }
+  catch (...) {
+    // a partial pipeline would wait for input that never comes
+    while (i-- > 0) {
+      try {
+        _handles[i]->shutdown();
+      }
+      catch (...) { }
+    }
+    throw;
+  }
+}
+
+
+
+/* --- run_parallel ------------------------------------------------- */
+
+static double clock_seconds ()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + now.tv_usec / 1e6;
+}
+
+
+void run_parallel (size_t _count, const char * const * _commands, char ** const * _arguments,
+                   char *const _environment[], const char * _workdir,
+                   process_handle_t::termination_mode_type _termination_mode,
+                   const spawn_options & _options, size_t _max_jobs, int _timeout,
+                   job_result * _results)
+{
+  // output is read here, straight from the pipes
+  spawn_options options = _options;
+  options.background_reader = false;
+
+  struct job_slot {
+    std::unique_ptr<process_handle_t> handle;
+    size_t job;
+    time_t deadline;
+  };
+
+  // children still running when an exception is thrown are killed
+  // by their handles
+  vector<job_slot> slots;
+  vector<struct pollfd> fds;
+  size_t next = 0;
+
+  // a job ends when its child exits; what is left in the pipes is
+  // read without waiting for other processes which may hold them
+  auto finish = [&](job_slot & _slot) {
+    process_handle_t & handle = *_slot.handle;
+    job_result & result = _results[_slot.job];
+
+    if (!handle.stdout_.eof) handle.stdout_.read(handle.pipe_stdout, false, true, false);
+    if (!handle.stderr_.eof) handle.stderr_.read(handle.pipe_stderr, false, true, false);
+
+    result.end = clock_seconds();
+    result.state = handle.state;
+    result.return_code = handle.return_code;
+    std::swap(result.stdout_, handle.stdout_);
+    std::swap(result.stderr_, handle.stderr_);
+    _slot.handle.reset();
+  };
+
+  while (next < _count || !slots.empty()) {
+    // a free slot takes the next command at once
+    while (slots.size() < _max_jobs && next < _count) {
+      job_slot slot;
+      slot.job = next++;
+      slot.handle.reset(new process_handle_t());
+
+      job_result & result = _results[slot.job];
+      result.start = clock_seconds();
+      try {
+        slot.handle->spawn(_commands[slot.job], _arguments[slot.job], _environment,
+                           _workdir, _termination_mode, options);
+      }
+      catch (subprocess_exception & e) {
+        result.end = result.start;
+        result.error = e.what();
+        continue;
+      }
+
+      // spawn() reaps a child which is already gone
+      if (slot.handle->state != process_handle_t::RUNNING) {
+        finish(slot);
+        continue;
+      }
+
+      slot.deadline = (_timeout < 0) ? 0 : clock_millisec() + _timeout;
+      slots.push_back(std::move(slot));
+    }
+
+    // output and exit of all running children; without pidfd exits
+    // are noticed through SIGCHLD, which is checked at intervals
+    fds.clear();
+    bool sigchld = false;
+    int wait_time = TIMEOUT_INFINITE;
+    time_t now = clock_millisec();
+
+    for (job_slot & slot : slots) {
+      process_handle_t & handle = *slot.handle;
+      fds.push_back({ handle.stdout_.eof ? -1 : handle.pipe_stdout, POLLIN, 0 });
+      fds.push_back({ handle.stderr_.eof ? -1 : handle.pipe_stderr, POLLIN, 0 });
+      fds.push_back({ handle.pid_fd, POLLIN, 0 });
+      sigchld = sigchld || handle.pid_fd == HANDLE_CLOSED;
+
+      if (_timeout >= 0 && !_results[slot.job].timed_out) {
+        int left = static_cast<int>(std::max<time_t>(0, slot.deadline - now));
+        wait_time = (wait_time < 0) ? left : std::min(wait_time, left);
+      }
+    }
+    if (sigchld) {
+      fds.push_back({ sigchld_fd(), POLLIN, 0 });
+      if (wait_time < 0 || wait_time > sigchld_interval) {
+        wait_time = sigchld_interval;
+      }
+    }
+
+    if (!slots.empty() && poll(fds.data(), fds.size(), wait_time) < 0 &&
+        errno != EINTR && errno != EAGAIN)
+    {
+      throw subprocess_exception(errno, "could not wait for child processes");
+    }
+    // drained before waitpid() so that no exit goes unnoticed
+    if (sigchld) {
+      sigchld_drain();
+    }
+
+    // from the back, so that a finished job can be replaced by the last one
+    now = clock_millisec();
+    for (size_t i = slots.size(); i-- > 0; ) {
+      job_slot & slot = slots[i];
+      process_handle_t & handle = *slot.handle;
+      const struct pollfd * ready = &fds[3 * i];
+
+      if (ready[0].revents) {
+        handle.stdout_.read(handle.pipe_stdout, false, true, ready[0].revents & (POLLHUP | POLLERR));
+      }
+      if (ready[1].revents) {
+        handle.stderr_.read(handle.pipe_stderr, false, true, ready[1].revents & (POLLHUP | POLLERR));
+      }
+      if (ready[2].revents || ready[2].fd == HANDLE_CLOSED) {
+        handle.wait(TIMEOUT_IMMEDIATE);
+      }
+
+      job_result & result = _results[slot.job];
+      if (handle.state == process_handle_t::RUNNING && _timeout >= 0 &&
+          !result.timed_out && now >= slot.deadline)
+      {
+        result.timed_out = true;
+        handle.kill();
+      }
+
+      if (handle.state != process_handle_t::RUNNING) {
+        finish(slot);
+        if (i != slots.size() - 1) {
+          slots[i] = std::move(slots.back());
+        }
+        slots.pop_back();
+      }
+    }
+  }
+}
+
+
+
+/* --- process_handle::shutdown ------------------------------------- */
+
+void process_handle_t::shutdown ()
+{
+  if (state == RUNNING && !child_id) {
+    throw subprocess_exception(ECHILD, "child does not exist");
+  }
+
+  /* the reader thread cannot outlive the pipes it reads from */
+  stop_reader();
+  stop_polling();
+
+  stdout_.tee = stderr_.tee = nullptr;
+  stdout_tee.close();
+  stderr_tee.close();
+
+  /* pipes stay open after the child exits, until the handle is gone */
+  auto close_pipe = [](pipe_handle_type & _pipe) {
+    if (_pipe != HANDLE_CLOSED) close(_pipe);
+    _pipe = HANDLE_CLOSED;
+  };
+
+  close_pipe(pipe_stdin);
+  close_pipe(pipe_stdout);
+  close_pipe(pipe_stderr);
+  stdin_.clear();
+
+  if (state != RUNNING) {
+    return;
+  }
+
+  /* closing pipes should let the child process exit */
+  // TODO there might be a need to send a termination signal first
+  wait(TIMEOUT_IMMEDIATE);
+  kill();
+  wait(TIMEOUT_INFINITE);
+
+  state = SHUTDOWN;
+}
+
+
+/* --- process::write ----------------------------------------------- */
+
+
+/*
+ * Run a write to the pipe which reports EPIPE but does not raise
+ * SIGPIPE when the child has closed its standard input: R's handler
+ * of that signal would long-jump out of this code. In MacOS the pipe
+ * is marked with F_SETNOSIGPIPE instead.
+ */
+template<typename F>
+static ssize_t without_sigpipe (F _write)
+{
+  ssize_t rc;
+#ifdef F_SETNOSIGPIPE
+  do {
+    rc = _write();
+  } while (rc < 0 && errno == EINTR);
+#else
+  sigset_t sigpipe, pending, previous;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, &previous);
+
+  sigpending(&pending);
+  bool was_pending = sigismember(&pending, SIGPIPE);
+
+  do {
+    rc = _write();
+  } while (rc < 0 && errno == EINTR);
+  int code = errno;
+
+  // consume the signal raised by this write
+  if (rc < 0 && code == EPIPE && !was_pending) {
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&sigpipe, NULL, &zero) < 0 && errno == EINTR);
+  }
+
+  pthread_sigmask(SIG_SETMASK, &previous, NULL);
+  errno = code;
+#endif
+  return rc;
+}
+
+
+static ssize_t writev_no_sigpipe (int _fd, const struct iovec * _iov, int _count)
+{
+  return without_sigpipe([=] { return ::writev(_fd, _iov, _count); });
+}
+
+
+static ssize_t write_no_sigpipe (int _fd, const void * _buffer, size_t _count)
+{
+  return without_sigpipe([=] { return ::write(_fd, _buffer, _count); });
+}
+
+
+/* --- output_tee --------------------------------------------------- */
+
+output_tee::output_tee () : file(HANDLE_CLOSED), error(0), reported(false) { }
+
+
+void output_tee::open (const char * _path, bool _append)
+{
+  close();
+
+  int fd;
+  do {
+    fd = ::open(_path, O_WRONLY | O_CREAT | O_CLOEXEC | (_append ? O_APPEND : O_TRUNC), 0666);
+  } while (fd < 0 && errno == EINTR);
+
+  if (fd < 0) {
+    throw subprocess_exception(errno, string("could not open ") + _path);
+  }
+  file = fd;
+}
+
+
+void output_tee::close ()
+{
+  if (file != HANDLE_CLOSED) ::close(file);
+  file = HANDLE_CLOSED;
+}
+
+
+/* a FIFO without a reader must not raise SIGPIPE in R */
+void output_tee::write (const char * _buffer, size_t _length)
+{
+  while (_length > 0 && file != HANDLE_CLOSED && !error) {
+    ssize_t rc = write_no_sigpipe(file, _buffer, _length);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc <= 0) {
+      error = rc < 0 ? errno : EIO;
+      break;
+    }
+    _buffer += rc;
+    _length -= rc;
+  }
+}
+
+
+/*
+ * Move the next part of a queued file into the pipe. In Linux the
+ * kernel does that with splice(), without copying data through user
+ * space; elsewhere, or if the file system does not support it, it is
+ * read into a buffer first. Nothing is lost if the pipe takes less
+ * than has been read: the file is read from a position, not a stream.
+ *
+ * @return As write(); 0 if the file has ended before its expected end.
+ */
+static ssize_t send_file (int _pipe, input_queue::chunk & _chunk)
+{
+#ifdef __linux__
+  ssize_t rc = without_sigpipe([&] {
+    loff_t position = _chunk.position;
+    return splice(_chunk.fd, &position, _pipe, NULL, _chunk.length,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  });
+  if (rc >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+    return rc;
+  }
+#endif
+
+  char buffer[65536];
+  ssize_t length;
+  do {
+    length = pread(_chunk.fd, buffer, std::min(_chunk.length, sizeof(buffer)),
+                   static_cast<off_t>(_chunk.position));
+  } while (length < 0 && errno == EINTR);
+
+  if (length <= 0) {
+    return length;
+  }
+  return write_no_sigpipe(_pipe, buffer, static_cast<size_t>(length));
+}
+
+
+/* buffers passed to a single writev() */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+static const int write_batch = IOV_MAX;
+#else
+static const int write_batch = 1024;
+#endif
+
+
+/* pieces shorter than this are copied together rather than passed
+ * to writev() one by one, which is costly for very short ones */
+static const size_t gather_limit = 256;
+static const size_t gather_size = 64 * 1024;
+
+
+/*
+ * Write buffers in batches, starting at byte `_offset` of buffer
+ * `_index`, until all are written or the pipe is full. The position
+ * is advanced past the bytes written.
+ *
+ * @return 0 or the error code of a failed write.
+ */
+static int write_buffers (int _fd, const input_buffer * _buffers, size_t _count,
+                          size_t & _index, size_t & _offset)
+{
+  vector<char> gathered;
+
+  while (_index < _count) {
+    struct iovec iov[write_batch];
+    int batch = 0;
+    size_t length = 0, used = 0;
+
+    for (size_t i = _index; i < _count; ++i) {
+      size_t skip = (i == _index) ? _offset : 0;
+      const char * data = _buffers[i].data + skip;
+      size_t size = _buffers[i].length - skip;
+      if (!size) continue;
+
+      if (size < gather_limit) {
+        if (gathered.empty()) gathered.resize(gather_size);
+        if (used + size > gathered.size()) break;
+
+        // extend the previous piece if it is the gathered tail
+        char * tail = gathered.data() + used;
+        memcpy(tail, data, size);
+        used += size;
+        length += size;
+        if (batch && static_cast<char *>(iov[batch - 1].iov_base) + iov[batch - 1].iov_len == tail) {
+          iov[batch - 1].iov_len += size;
+          continue;
+        }
+        if (batch == write_batch) {
+          used -= size;
+          length -= size;
+          break;
+        }
+        iov[batch].iov_base = tail;
+        iov[batch++].iov_len = size;
+        continue;
+      }
+
+      if (batch == write_batch) break;
+      iov[batch].iov_base = const_cast<char *>(data);
+      iov[batch++].iov_len = size;
+      length += size;
+    }
+    if (!batch) {
+      _index = _count;
+      break;
+    }
+
+    ssize_t rc = writev_no_sigpipe(_fd, iov, batch);
+    if (rc < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return errno;
+    }
+
+    for (size_t left = static_cast<size_t>(rc); _index < _count; ++_index, _offset = 0) {
+      size_t available = _buffers[_index].length - _offset;
+      if (left < available) {
+        _offset += left;
+        break;
+      }
+      left -= available;
+    }
+
+    // a short write means the pipe is full
+    if (static_cast<size_t>(rc) < length) break;
+  }
+
+  return 0;
+}
+
+
+static void close_input_pipe (process_handle_t & _handle)
+{
+  if (_handle.polling.registered) {
+    poller().forget(_handle.pipe_stdin);
+  }
+  close(_handle.pipe_stdin);
+  _handle.pipe_stdin = HANDLE_CLOSED;
+  _handle.stdin_.close_pending = false;
+}
+
+
+/*
+ * Write as much queued input as the pipe takes without blocking, and
+ * close the pipe if it has been requested. If the child has closed
+ * its input, queued data can never be delivered and is dropped.
+ *
+ * @return 0 or the error code of a failed write.
+ */
+static int write_input (process_handle_t & _handle)
+{
+  input_queue & queue = _handle.stdin_;
+  int code = 0;
+
+  while (queue.size() && _handle.pipe_stdin != HANDLE_CLOSED) {
+    input_queue::chunk & chunk = queue.front();
+    ssize_t rc = (chunk.fd < 0) ?
+      write_no_sigpipe(_handle.pipe_stdin, chunk.data.data() + chunk.offset, chunk.size()) :
+      send_file(_handle.pipe_stdin, chunk);
+
+    if (rc < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      code = errno;
+      queue.clear();
+      break;
+    }
+
+    // the file is shorter than it was when queued
+    if (rc == 0 && chunk.fd >= 0) {
+      queue.drop();
+      continue;
+    }
+    queue.pop(static_cast<size_t>(rc));
+  }
+
+  if (!queue.size() && queue.close_pending) {
+    close_input_pipe(_handle);
+  }
+
+  return code;
+}
+
+
+size_t process_handle_t::write (const input_buffer * _buffers, size_t _count, int _timeout)
+{
+  if (!child_id) {
+    throw subprocess_exception(ECHILD, "child does not exist");
+  }
+  if (pipe_stdin == HANDLE_CLOSED || stdin_.close_pending) {
+    throw subprocess_exception(EALREADY, "child's standard input already closed");
+  }
+
+  size_t total = 0;
+  for (size_t i = 0; i < _count; ++i) {
+    total += _buffers[i].length;
+  }
+
+  // input is written straight from the caller's buffers for as long
+  // as the call lasts; only what is left at the end is copied
+  size_t index = 0, offset = 0;
+  time_t start = clock_millisec();
+
+  while (true) {
+    int code = write_input(*this);
+    if (!code && !stdin_.size()) {
+      code = write_buffers(pipe_stdin, _buffers, _count, index, offset);
+    }
+    if (code) {
+      throw subprocess_exception(code, "could not write to child process");
+    }
+    if ((index == _count && !stdin_.size()) || _timeout == TIMEOUT_IMMEDIATE) {
+      break;
+    }
+
+    int remaining = TIMEOUT_INFINITE;
+    if (_timeout > 0) {
+      remaining = _timeout - static_cast<int>(clock_millisec() - start);
+      if (remaining <= 0) break;
+    }
+
+    struct pollfd fd = { pipe_stdin, POLLOUT, 0 };
+    if (poll(&fd, 1, remaining) < 0 && errno != EINTR) {
+      throw subprocess_exception(errno, "could not write to child process");
+    }
+  }
+
+  for (; index < _count; ++index, offset = 0) {
+    stdin_.push(_buffers[index].data + offset, _buffers[index].length - offset);
+  }
+
+  return total;
+}
+
+
+size_t process_handle_t::write_file (const char * _path, int64_t _offset, int64_t _length,
+                                     int _timeout)
+{
+  if (!child_id) {
+    throw subprocess_exception(ECHILD, "child does not exist");
+  }
+  if (pipe_stdin == HANDLE_CLOSED || stdin_.close_pending) {
+    throw subprocess_exception(EALREADY, "child's standard input already closed");
+  }
+
+  int fd = open(_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw subprocess_exception(errno, string("could not open ") + _path);
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    int code = errno;
+    close(fd);
+    throw subprocess_exception(code, string("could not read size of ") + _path);
+  }
+
+  int64_t size = static_cast<int64_t>(info.st_size);
+  int64_t start = std::min(std::max<int64_t>(_offset, 0), size);
+  int64_t length = size - start;
+  if (_length >= 0) {
+    length = std::min(length, _length);
+  }
+
+  if (length > 0) {
+    stdin_.push_file(fd, start, static_cast<size_t>(length));
+  }
+  else {
+    close(fd);
+  }
+
+  time_t started = clock_millisec();
+  while (true) {
+    int code = write_input(*this);
+    if (code) {
+      throw subprocess_exception(code, "could not write to child process");
+    }
+    if (!stdin_.size() || _timeout == TIMEOUT_IMMEDIATE) {
+      break;
+    }
+
+    int remaining = TIMEOUT_INFINITE;
+    if (_timeout > 0) {
+      remaining = _timeout - static_cast<int>(clock_millisec() - started);
+      if (remaining <= 0) break;
+    }
+
+    struct pollfd pfd = { pipe_stdin, POLLOUT, 0 };
+    if (poll(&pfd, 1, remaining) < 0 && errno != EINTR) {
+      throw subprocess_exception(errno, "could not write to child process");
+    }
+  }
+
+  return static_cast<size_t>(length);
+}
+
+
+/* --- process::read ------------------------------------------------ */
+
+
+struct enable_block_mode {
+  int fd;
+
+  enable_block_mode (int _fd) : fd (_fd) {
+    set_block(fd);
+  }
+
+  ~enable_block_mode () {
+    set_non_block(fd);
+  }
+};
+
+
+ssize_t timed_read (process_handle_t & _handle, pipe_type _pipe, int _timeout, bool _flush, bool _binary)
+{
+  // binary output is passed as-is, without multi-byte verification
+  bool verify = mbcslocale && !_binary;
+
+  struct pollfd fds[4];
+  fds[0].fd = -1;
+  fds[1].fd = -1;
+
+  // queued input is written whenever the child can take it
+  write_input(_handle);
+  fds[3].events = POLLOUT;
+
+  // do not wait for output once the child has exited
+  fds[2].fd = _handle.pid_fd;
+  fds[2].events = POLLIN;
+  fds[2].revents = 0;
+
+  // a pipe which has reached its end is not polled any more
+  if (_pipe & PIPE_STDOUT) {
+    _handle.stdout_.clear();
+    if (!_handle.stdout_.eof) {
+      fds[0].fd = _handle.pipe_stdout;
+      fds[0].events = POLLIN;
+    }
+  }
+
+  if (_pipe & PIPE_STDERR) {
+    _handle.stderr_.clear();
+    if (!_handle.stderr_.eof) {
+      fds[1].fd = _handle.pipe_stderr;
+      fds[1].events = POLLIN;
+    }
+  }
+
+  // nothing more will come from the selected pipes
+  if (fds[0].fd == -1 && fds[1].fd == -1) {
+    return 0;
+  }
+
+  time_t start = clock_millisec(), timediff = _timeout;
+  ssize_t rc;
+
+  do {
+    fds[3].fd = _handle.stdin_.size() ? _handle.pipe_stdin : -1;
+    fds[3].revents = 0;
+
+    rc = poll(fds, 4, timediff);
+    if (_timeout >= 0) {
+      timediff = _timeout - (clock_millisec() - start);
+    }
+
+    // interrupted or kernel failed to allocate internal resources
+    if (rc < 0 && (errno == EINTR || errno == EAGAIN)) {
+      rc = 0;
+    }
+
+    if (rc > 0 && fds[3].fd != -1 && fds[3].revents) {
+      write_input(_handle);
+      --rc;
+    }
+  } while (rc == 0 && (_timeout < 0 || timediff > 0));
+
+  if (rc > 0 && fds[2].fd != -1 && fds[2].revents) {
+    _handle.wait(TIMEOUT_IMMEDIATE);
+    --rc;
+  }
+
+  // nothing to read
+  if (rc <= 0) {
+    return rc;
+  }
+
+  // after hang-up the pipe is read until its end, which often comes
+  // together with the last piece of output
+  auto read_pipe = [&] (const struct pollfd & _fd, pipe_writer & _writer) -> size_t {
+    if (_fd.fd == -1 || !(_fd.revents & (POLLIN | POLLHUP))) return 0;
+    bool hangup = (_fd.revents & POLLHUP) != 0;
+    return _writer.read(_fd.fd, verify, _flush || hangup, hangup);
+  };
+
+  // TODO if an error occurs in the first read() it will be lost
+  return read_pipe(fds[0], _handle.stdout_) + read_pipe(fds[1], _handle.stderr_);
+}
+
+
+void process_handle_t::stop_reader ()
+{
+  delete reader;
+  reader = nullptr;
+}
+
+
+size_t process_handle_t::read (pipe_type _pipe, int _timeout, bool _flush, bool _binary)
+{
+  if (!child_id) {
+    throw subprocess_exception(ECHILD, "child does not exist");
+  }
+
+  if (reader) {
+    if (_pipe & PIPE_STDOUT) stdout_.clear();
+    if (_pipe & PIPE_STDERR) stderr_.clear();
+
+    // the reader thread does not write; queued input is fed from here
+    // in slices until there is output to hand over
+    time_t start = clock_millisec();
+    int remaining = _timeout;
+    while (!write_input(*this) && stdin_.size() && remaining != 0 &&
+           !reader->available(_pipe))
+    {
+      int slice = input_check_interval;
+      if (remaining > 0) {
+        slice = std::min(slice, remaining);
+      }
+
+      struct pollfd fd = { pipe_stdin, POLLOUT, 0 };
+      if (poll(&fd, 1, slice) < 0 && errno != EINTR) {
+        throw subprocess_exception(errno, "could not write to child process");
+      }
+
+      if (_timeout > 0) {
+        remaining = std::max(0, _timeout - static_cast<int>(clock_millisec() - start));
+      }
+    }
+
+    return reader->read(*this, _pipe, remaining, mbcslocale && !_binary);
+  }
+
+  ssize_t rc = timed_read(*this, _pipe, _timeout, _flush, _binary);
+
+  if (polling.registered) {
+    poller().rearm(*this, _pipe);
+  }
+
+  if (rc < 0) {
+    throw subprocess_exception(errno, "could not read from child process");
+  }
+
+  return static_cast<size_t>(rc);
+}
+
+
+bool process_handle_t::read_until (output_matcher * _stdout, output_matcher * _stderr, int _timeout, bool _binary)
+{
+  if (!child_id) {
+    throw subprocess_exception(ECHILD, "child does not exist");
+  }
+
+  output_matcher * matchers[2] = { _stdout, _stderr };
+  pipe_writer * writers[2]     = { &stdout_, &stderr_ };
+  pipe_handle_type pipes[2]    = { pipe_stdout, pipe_stderr };
+  pipe_type types[2]           = { PIPE_STDOUT, PIPE_STDERR };
+  bool verify = mbcslocale && !_binary;
+
+  // data handed back by the previous match is searched first
+  for (int i = 0; i < 2; ++i) {
+    if (!matchers[i]) continue;
+    writers[i]->clear();
+    matchers[i]->reset();
+  }
+
+  time_t start = clock_millisec();
+  int remaining = _timeout;
+  bool found = false;
+
+  // with no time left one attempt to read is still made
+  for (bool attempted = false; ; attempted = true) {
+    int waiting = 0;
+    bool ended = false;
+    for (int i = 0; i < 2; ++i) {
+      if (!matchers[i]) continue;
+      size_t end = matchers[i]->find(writers[i]->data(), writers[i]->size());
+      if (end != output_matcher::npos) {
+        writers[i]->keep(writers[i]->size() - end);
+        matchers[i] = nullptr;
+        continue;
+      }
+      waiting |= types[i];
+      ended = ended || writers[i]->eof;
+    }
+
+    if (!waiting) {
+      found = true;
+      break;
+    }
+
+    if (_timeout > 0) {
+      remaining = std::max(0, _timeout - static_cast<int>(clock_millisec() - start));
+    }
+    if (ended || (attempted && remaining == 0)) {
+      break;
+    }
+
+    // queued input may be what the child waits for before it answers
+    write_input(*this);
+    int wait_time = remaining;
+    if (stdin_.size()) {
+      wait_time = (remaining < 0) ? input_check_interval : std::min(remaining, input_check_interval);
+    }
+
+    if (reader) {
+      reader->read(*this, static_cast<pipe_type>(waiting), wait_time, verify);
+      continue;
+    }
+
+    struct pollfd fds[2] = {
+      { matchers[0] ? pipes[0] : -1, POLLIN, 0 },
+      { matchers[1] ? pipes[1] : -1, POLLIN, 0 }
+    };
+    int rc = poll(fds, 2, wait_time);
+    if (rc < 0 && errno != EINTR && errno != EAGAIN) {
+      throw subprocess_exception(errno, "could not read from child process");
+    }
+    for (int i = 0; rc > 0 && i < 2; ++i) {
+      if (fds[i].revents) {
+        writers[i]->read(pipes[i], verify, true, fds[i].revents & (POLLHUP | POLLERR));
+      }
+    }
+  }
+
+  if (polling.registered) {
+    poller().rearm(*this, PIPE_BOTH);
+  }
+
+  return found;
+}
+
+
+/* --- process::close_input ----------------------------------------- */
+
+void process_handle_t::close_input ()
+{
+  if (pipe_stdin == HANDLE_CLOSED || stdin_.close_pending) {
+    throw subprocess_exception(EALREADY, "child's standard input already closed");
+  }
+
+  // queued input is delivered first
+  stdin_.close_pending = true;
+  write_input(*this);
+}
+
+
+/* --- process::communicate ----------------------------------------- */
+
+void process_handle_t::communicate (const input_buffer * _input, size_t _count, int _timeout, bool _binary)
+{
+  if (!child_id) {
+    throw subprocess_exception(ECHILD, "child does not exist");
+  }
+
+  // position of the first byte of input not written yet
+  size_t index = 0, offset = 0;
+  while (index < _count && !_input[index].length) ++index;
+
+  if (index < _count && (pipe_stdin == HANDLE_CLOSED || stdin_.close_pending)) {
+    throw subprocess_exception(EALREADY, "child's standard input already closed");
+  }
+
+  bool verify = mbcslocale && !_binary;
+
+  // output accumulates; it is handed over to R only at the end
+  stdout_.clear();
+  stderr_.clear();
+
+  time_t start = clock_millisec();
+  int remaining = _timeout;
+
+  while (true) {
+    // input queued by earlier writes goes first; the rest is written
+    // straight from the caller's buffers; a child which closed its
+    // input does not want the rest of it
+    int code = write_input(*this);
+    if (!code && !stdin_.size() && pipe_stdin != HANDLE_CLOSED) {
+      code = write_buffers(pipe_stdin, _input, _count, index, offset);
+    }
+    if (code == EPIPE) {
+      index = _count;
+    }
+    else if (code) {
+      throw subprocess_exception(code, "could not write to child process");
+    }
+
+    bool feeding = pipe_stdin != HANDLE_CLOSED && (index < _count || stdin_.size());
+    if (pipe_stdin != HANDLE_CLOSED && !feeding) {
+      close_input_pipe(*this);
+    }
+
+    if (!feeding && stdout_.eof && stderr_.eof) {
+      break;
+    }
+
+    if (_timeout > 0) {
+      remaining = std::max(0, _timeout - static_cast<int>(clock_millisec() - start));
+    }
+    if (remaining == 0) {
+      break;
+    }
+
+    // output is drained by the reader thread; input is fed from here
+    if (reader) {
+      if (feeding) {
+        int slice = input_check_interval;
+        if (remaining > 0) {
+          slice = std::min(slice, remaining);
+        }
+        struct pollfd fd = { pipe_stdin, POLLOUT, 0 };
+        if (poll(&fd, 1, slice) < 0 && errno != EINTR) {
+          throw subprocess_exception(errno, "could not write to child process");
+        }
+      }
+      reader->read(*this, PIPE_BOTH, feeding ? TIMEOUT_IMMEDIATE : remaining, verify);
+      continue;
+    }
+
+    struct pollfd fds[3] = {
+      { feeding ? pipe_stdin : -1, POLLOUT, 0 },
+      { stdout_.eof ? -1 : pipe_stdout, POLLIN, 0 },
+      { stderr_.eof ? -1 : pipe_stderr, POLLIN, 0 }
+    };
+
+    if (poll(fds, 3, remaining) < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      throw subprocess_exception(errno, "could not communicate with child process");
+    }
+
+    // keep reading into the growing buffers; drain on hang-up
+    if (fds[1].revents) {
+      stdout_.read(pipe_stdout, verify, true, fds[1].revents & (POLLHUP | POLLERR));
+    }
+    if (fds[2].revents) {
+      stderr_.read(pipe_stderr, verify, true, fds[2].revents & (POLLHUP | POLLERR));
+    }
+  }
+
+  // out of time: the rest of input will be fed later, as after write()
+  for (; index < _count; ++index, offset = 0) {
+    stdin_.push(_input[index].data + offset, _input[index].length - offset);
+  }
+  if (stdin_.size()) {
+    stdin_.close_pending = true;
+  }
+
+  if (polling.registered) {
+    poller().rearm(*this, PIPE_BOTH);
+  }
+
+  wait(remaining);
+}
+
+
+/* --- process::wait ------------------------------------------------ */
+
+
+void process_handle_t::wait (int _timeout)
+{
+  if (!child_id) {
+    throw subprocess_exception(ECHILD, "child does not exist");
+  }
+  if (state != RUNNING) {
+    return;
+  }
+
+  /* a timed wait, or one which feeds the child with queued input,
+   * sleeps in poll() until the child exits */
+  write_input(*this);
+  int exit_fd = pid_fd;
+  if (exit_fd == HANDLE_CLOSED && (_timeout > 0 || stdin_.size())) {
+    exit_fd = sigchld_fd();
+  }
+
+  time_t start = clock_millisec();
+  int rc;
+
+  while (true) {
+    // drained before waitpid() so that no exit goes unnoticed
+    if (exit_fd != pid_fd) {
+      sigchld_drain();
+    }
+
+    /* to wait or not to wait? */
+    bool feeding = stdin_.size() > 0;
+    int options = (_timeout >= 0 || feeding) ? WNOHANG : 0;
+
+    rc = waitpid(child_id, &return_code, options);
+
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    // there's been an error (<0)
+    if (rc < 0) {
+      throw subprocess_exception(errno, "waitpid() failed");
+    }
+    if (rc > 0 || _timeout == 0) {
+      break;
+    }
+
+    int remaining = TIMEOUT_INFINITE;
+    if (_timeout > 0) {
+      remaining = _timeout - static_cast<int>(clock_millisec() - start);
+      if (remaining <= 0) break;
+    }
+    if (exit_fd != pid_fd && (remaining < 0 || remaining > sigchld_interval)) {
+      remaining = sigchld_interval;
+    }
+
+    struct pollfd fds[2] = { { exit_fd, POLLIN, 0 },
+                             { feeding ? pipe_stdin : -1, POLLOUT, 0 } };
+    if (poll(fds, 2, remaining) < 0 && errno != EINTR) {
+      throw subprocess_exception(errno, "could not wait for child process");
+    }
+    if (fds[1].revents) {
+      write_input(*this);
+    }
+  }
+
+  // the child is still running
+  if (rc == 0) {
+     return;
+  }
+
+  // the child is gone and so is the need to watch it
+  if (pid_fd != HANDLE_CLOSED) {
+    if (polling.registered) {
+      poller().forget(pid_fd);
+    }
+    ::close(pid_fd);
+    pid_fd = HANDLE_CLOSED;
   }
 
   // the child has exited or has been terminated
@@ -82,10 +82,51 @@ process_handle_t::process_handle_t ()
   : process_job(nullptr), child_handle(nullptr),
     pipe_stdin(HANDLE_CLOSED), pipe_stdout(HANDLE_CLOSED), pipe_stderr(HANDLE_CLOSED),
     child_id(0), state(NOT_STARTED), return_code(0),
-    termination_mode(TERMINATION_GROUP)
+    termination_mode(TERMINATION_GROUP), pipe_capacity{ 0, 0, 0 }, reader(nullptr), dropped(0)
 {}
 
 
+/* --- output_tee --------------------------------------------------- */
+
+output_tee::output_tee () : file(HANDLE_CLOSED), error(0), reported(false) { }
+
+
+void output_tee::open (const char * _path, bool _append)
+{
+  close();
+
+  HANDLE handle = ::CreateFileA(_path, _append ? FILE_APPEND_DATA : GENERIC_WRITE,
+                                FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                _append ? OPEN_ALWAYS : CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    throw subprocess_exception(::GetLastError(), string("could not open ") + _path);
+  }
+  file = handle;
+}
+
+
+void output_tee::close ()
+{
+  if (file != HANDLE_CLOSED) ::CloseHandle(file);
+  file = HANDLE_CLOSED;
+}
+
+
+void output_tee::write (const char * _buffer, size_t _length)
+{
+  while (_length > 0 && file != HANDLE_CLOSED && !error) {
+    DWORD written = 0;
+    if (!::WriteFile(file, _buffer, (DWORD)_length, &written, NULL)) {
+      error = ::GetLastError();
+      break;
+    }
+    _buffer += written;
+    _length -= written;
+  }
+}
+
+
 /* ------------------------------------------------------------------ */
 
 struct Handle {
@@ -110,24 +151,30 @@ struct StartupInfo {
   struct pipe_holder {
     Handle read, write;
 
-    pipe_holder(SECURITY_ATTRIBUTES & sa)
+    // the size is only a suggestion to the system, 0 is the default
+    pipe_holder(SECURITY_ATTRIBUTES & sa, DWORD size)
       : read(nullptr), write(nullptr)
     {
-      if (!::CreatePipe(read.address(), write.address(), &sa, 0)) {
+      if (!::CreatePipe(read.address(), write.address(), &sa, size)) {
         throw subprocess_exception(GetLastError(), "could not create pipe");
       }
     }
   };
 
-  StartupInfo (process_handle_t & _process, DWORD & _creation_flags) {
+  StartupInfo (process_handle_t & _process, DWORD & _creation_flags,
+               const spawn_options & _options) {
     memset(&info, 0, sizeof(STARTUPINFO));
     info.cb = sizeof(STARTUPINFO);
 
-    pipe_redirection(_process);
+    pipe_redirection(_process, _options);
     hidden_window(_creation_flags);
   }
 
   ~StartupInfo () {
+    // stderr merged with stdout is the same handle
+    if (info.hStdError == info.hStdOutput) {
+      info.hStdError = HANDLE_CLOSED;
+    }
     CloseHandle(info.hStdInput);
     CloseHandle(info.hStdOutput);
     CloseHandle(info.hStdError);
@@ -135,9 +182,10 @@ struct StartupInfo {
 
 
   /*
-   * Set standard input/output redirection via pipes.
+   * Set standard input/output redirection via pipes, or to files and
+   * parent's handles as requested in `_options`.
    */
-  void pipe_redirection (process_handle_t & _process)
+  void pipe_redirection (process_handle_t & _process, const spawn_options & _options)
   {
     // Set the bInheritHandle flag so pipe handles are inherited
     SECURITY_ATTRIBUTES sa;
@@ -145,29 +193,89 @@ struct StartupInfo {
     sa.bInheritHandle = TRUE;
     sa.lpSecurityDescriptor = NULL;
 
-    pipe_holder in(sa), out(sa), err(sa);
+    Handle in, out, err;
+    HANDLE * parent[3] = { &_process.pipe_stdin, &_process.pipe_stdout, &_process.pipe_stderr };
+    Handle * child[3]  = { &in, &out, &err };
+
+    for (int i = 0; i < 3; ++i) {
+      switch (_options.redirect[i]) {
+      case spawn_options::REDIRECT_PIPE: {
+        pipe_holder pipe(sa, (DWORD)std::min<size_t>(_options.pipe_size[i], MAXDWORD));
+        _process.pipe_capacity[i] = _options.pipe_size[i];
+
+        // Ensure the parent's end is not inherited: create a new
+        // handle with the Properties set to FALSE. Otherwise, the child
+        // inherits the properties and, as a result, non-closeable
+        // handles to the pipes are created.
+        Handle & ours = (i == PIPE_STDIN) ? pipe.write : pipe.read;
+        Handle & theirs = (i == PIPE_STDIN) ? pipe.read : pipe.write;
+        DuplicateHandle(ours, parent[i]);
+        *child[i] = theirs.move();
+        break;
+      }
 
-    // Ensure the write handle to the pipe for STDIN is not inherited.
-    if (!::SetHandleInformation(in.write, HANDLE_FLAG_INHERIT, 0)) {
-      throw subprocess_exception(GetLastError(), "could not set handle information");
-    }
+      case spawn_options::REDIRECT_NULL:
+        *child[i] = open_file("NUL", i == PIPE_STDIN, false, sa);
+        break;
+
+      case spawn_options::REDIRECT_INHERIT: {
+        DWORD which[3] = { STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE };
+        HANDLE handle = ::GetStdHandle(which[i]);
+        if (handle == INVALID_HANDLE_VALUE || handle == NULL) {
+          throw subprocess_exception(GetLastError(), "could not get standard handle");
+        }
+        if (!::DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(),
+                               child[i]->address(), 0, TRUE, DUPLICATE_SAME_ACCESS))
+        {
+          throw subprocess_exception(GetLastError(), "cannot duplicate handle");
+        }
+        break;
+      }
 
-    // Create new output read handle and the input write handles. Set
-    // the Properties to FALSE. Otherwise, the child inherits the
-    // properties and, as a result, non-closeable handles to the pipes
-    // are created.
-    DuplicateHandle(in.write, &_process.pipe_stdin);
-    DuplicateHandle(out.read, &_process.pipe_stdout);
-    DuplicateHandle(err.read, &_process.pipe_stderr);
+      case spawn_options::REDIRECT_FILE:
+        *child[i] = open_file(_options.redirect_path[i], i == PIPE_STDIN,
+                              _options.redirect_append[i], sa);
+        break;
+
+      case spawn_options::REDIRECT_STDOUT:
+        if (i != PIPE_STDERR) {
+          throw subprocess_exception(ERROR_INVALID_PARAMETER, "only standard error can be redirected to standard output");
+        }
+        break;
+
+      case spawn_options::REDIRECT_FD:
+        throw subprocess_exception(ERROR_NOT_SUPPORTED, "redirecting to a descriptor is not supported in Windows");
+      }
+    }
 
     // prepare the info object
     info.dwFlags |= STARTF_USESTDHANDLES;
 
     // "move" means "set to null" so that destructor does not close
     // those handles
-    info.hStdError  = err.write.move();
-    info.hStdOutput = out.write.move();
-    info.hStdInput  = in.read.move();
+    info.hStdInput  = in.move();
+    info.hStdOutput = out.move();
+    info.hStdError  = (_options.redirect[PIPE_STDERR] == spawn_options::REDIRECT_STDOUT) ?
+                        info.hStdOutput : err.move();
+  }
+
+  /*
+   * Open a file as a child's standard stream; the handle is inheritable.
+   */
+  static HANDLE open_file (const char * _path, bool _input, bool _append,
+                           SECURITY_ATTRIBUTES & _sa)
+  {
+    HANDLE handle = ::CreateFile(_path,
+                                 _input ? GENERIC_READ : (_append ? FILE_APPEND_DATA : GENERIC_WRITE),
+                                 FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 &_sa,
+                                 _input ? OPEN_EXISTING : (_append ? OPEN_ALWAYS : CREATE_ALWAYS),
+                                 FILE_ATTRIBUTE_NORMAL,
+                                 NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+      throw subprocess_exception(GetLastError(), string("could not open ") + _path);
+    }
+    return handle;
   }
 
   /*
@@ -279,8 +387,19 @@ static HANDLE CreateAndAssignChildToJob (HANDLE _process)
 //
 void process_handle_t::spawn (const char * _command, char *const _arguments[],
                              char *const _environment[], const char * _workdir,
-                             termination_mode_type _termination_mode)
+                             termination_mode_type _termination_mode,
+                             const spawn_options & _options)
 {
+  if (_options.engine != spawn_options::ENGINE_AUTO) {
+    throw subprocess_exception(ERROR_NOT_SUPPORTED, "spawn engine cannot be chosen in Windows");
+  }
+  if (_options.background_reader) {
+    throw subprocess_exception(ERROR_NOT_SUPPORTED, "background reader is not supported in Windows");
+  }
+  if (_options.keep_fds_count) {
+    throw subprocess_exception(ERROR_NOT_SUPPORTED, "keep_fds is not supported in Windows");
+  }
+
   /* if the command is part of arguments, pass NULL to CreateProcess */
   if (!strcmp(_arguments[0], _command)) {
     _command = NULL;
@@ -301,8 +420,11 @@ void process_handle_t::spawn (const char * _command, char *const _arguments[],
   // creation flags
   DWORD creation_flags = CREATE_NEW_PROCESS_GROUP;
 
+  // log files first, nothing to clean up if they cannot be opened
+  open_tees(_options);
+
   // update pipe handles and creation flags
-  StartupInfo startupInfo(*this, creation_flags);
+  StartupInfo startupInfo(*this, creation_flags, _options);
 
   // if termination is set to "group", create a job for this process;
   // attempt at it at the beginning and not even try to start the process
@@ -380,26 +502,114 @@ void process_handle_t::shutdown ()
   CloseHandle(pipe_stdin);
   CloseHandle(pipe_stdout);
   CloseHandle(pipe_stderr);
+
+  stdout_.tee = stderr_.tee = nullptr;
+  stdout_tee.close();
+  stderr_tee.close();
+}
+
+
+/* background reader is never started in Windows */
+void process_handle_t::stop_reader ()
+{
+  reader = nullptr;
+}
+
+
+/* handles are never registered for polling in Windows */
+void process_handle_t::stop_polling ()
+{
+  polling.registered = false;
 }
 
 
 /* --- process::write ----------------------------------------------- */
 
-size_t process_handle_t::write (const void * _buffer, size_t _count)
+/* anonymous pipes do not support overlapped I/O: the write blocks
+ * until all data is taken and `_timeout` is ignored */
+size_t process_handle_t::write (const input_buffer * _buffers, size_t _count, int _timeout)
 {
-  DWORD written = 0;
-  if (!::WriteFile(pipe_stdin, _buffer, (DWORD)_count, &written, NULL)) {
-    throw subprocess_exception(::GetLastError(), "could not write to child process");
+  if (pipe_stdin == HANDLE_CLOSED) {
+    throw subprocess_exception(ERROR_INVALID_HANDLE, "child's standard input already closed");
+  }
+
+  size_t total = 0;
+
+  for (size_t i = 0; i < _count; ++i) {
+    const char * buffer = _buffers[i].data;
+    size_t left = _buffers[i].length;
+
+    while (left > 0) {
+      DWORD written = 0;
+      if (!::WriteFile(pipe_stdin, buffer, (DWORD)left, &written, NULL)) {
+        throw subprocess_exception(::GetLastError(), "could not write to child process");
+      }
+      buffer += written;
+      left -= written;
+    }
+
+    total += _buffers[i].length;
   }
 
-  return static_cast<size_t>(written);
+  return total;
+}
+
+
+size_t process_handle_t::write_file (const char * _path, int64_t _offset, int64_t _length,
+                                     int _timeout)
+{
+  HANDLE file = ::CreateFileA(_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw subprocess_exception(::GetLastError(), string("could not open ") + _path);
+  }
+
+  LARGE_INTEGER position;
+  position.QuadPart = std::max<int64_t>(_offset, 0);
+  if (!::SetFilePointerEx(file, position, NULL, FILE_BEGIN)) {
+    DWORD error = ::GetLastError();
+    ::CloseHandle(file);
+    throw subprocess_exception(error, string("could not seek in ") + _path);
+  }
+
+  // writes block anyway, so the file is simply copied
+  vector<char> buffer(65536);
+  size_t total = 0;
+
+  while (_length < 0 || total < static_cast<size_t>(_length)) {
+    DWORD length = (DWORD)buffer.size();
+    if (_length >= 0) {
+      length = (DWORD)std::min<size_t>(length, static_cast<size_t>(_length) - total);
+    }
+
+    DWORD read = 0;
+    if (!::ReadFile(file, buffer.data(), length, &read, NULL)) {
+      DWORD error = ::GetLastError();
+      ::CloseHandle(file);
+      throw subprocess_exception(error, string("could not read ") + _path);
+    }
+    if (!read) break;
+
+    input_buffer piece = { buffer.data(), read };
+    try {
+      write(&piece, 1, _timeout);
+    }
+    catch (...) {
+      ::CloseHandle(file);
+      throw;
+    }
+    total += read;
+  }
+
+  ::CloseHandle(file);
+  return total;
 }
 
 
 /* --- process::read ------------------------------------------------ */
 
 
-size_t process_handle_t::read (pipe_type _pipe, int _timeout)
+size_t process_handle_t::read (pipe_type _pipe, int _timeout, bool _flush, bool _binary)
 {
   stdout_.clear();
   stderr_.clear();
@@ -413,11 +623,15 @@ size_t process_handle_t::read (pipe_type _pipe, int _timeout)
 
   do {
     size_t rc1 = 0, rc2 = 0;
-    if (_pipe & PIPE_STDOUT) rc1 = stdout_.read(pipe_stdout);
-    if (_pipe & PIPE_STDERR) rc2 = stderr_.read(pipe_stderr);
+    if (_pipe & PIPE_STDOUT) rc1 = stdout_.read(pipe_stdout, false, _flush);
+    if (_pipe & PIPE_STDERR) rc2 = stderr_.read(pipe_stderr, false, _flush);
+
+    // nothing more will come from the selected pipes
+    bool ended = (!(_pipe & PIPE_STDOUT) || stdout_.eof) &&
+                 (!(_pipe & PIPE_STDERR) || stderr_.eof);
 
     // if anything has been read or no timeout is specified return now
-    if (rc1 > 0 || rc2 > 0 || sleep_time == 0) {
+    if (rc1 > 0 || rc2 > 0 || sleep_time == 0 || ended) {
       return std::max(rc1, rc2);
     }
 
@@ -432,6 +646,58 @@ size_t process_handle_t::read (pipe_type _pipe, int _timeout)
 }
 
 
+bool process_handle_t::read_until (output_matcher * _stdout, output_matcher * _stderr, int _timeout, bool _binary)
+{
+  output_matcher * matchers[2] = { _stdout, _stderr };
+  pipe_writer * writers[2]     = { &stdout_, &stderr_ };
+  pipe_handle_type pipes[2]    = { pipe_stdout, pipe_stderr };
+
+  // data handed back by the previous match is searched first
+  for (int i = 0; i < 2; ++i) {
+    if (!matchers[i]) continue;
+    writers[i]->clear();
+    matchers[i]->reset();
+  }
+
+  ULONGLONG start = GetTickCount64();
+  int timediff = 0, sleep_time = 10;
+
+  // with no time left one attempt to read is still made
+  for (bool attempted = false; ; attempted = true) {
+    bool waiting = false, ended = false;
+    for (int i = 0; i < 2; ++i) {
+      if (!matchers[i]) continue;
+      size_t end = matchers[i]->find(writers[i]->data(), writers[i]->size());
+      if (end != output_matcher::npos) {
+        writers[i]->keep(writers[i]->size() - end);
+        matchers[i] = nullptr;
+        continue;
+      }
+      waiting = true;
+      ended = ended || writers[i]->eof;
+    }
+
+    if (!waiting) {
+      return true;
+    }
+    if (ended || (attempted && _timeout >= 0 && timediff >= _timeout)) {
+      return false;
+    }
+
+    // pipes cannot be waited on; sleep only when nothing came
+    size_t got = 0;
+    for (int i = 0; i < 2; ++i) {
+      if (matchers[i]) got += writers[i]->read(pipes[i], false, true);
+    }
+    if (!got) {
+      if (_timeout >= 0) sleep_time = std::min(sleep_time, _timeout - timediff);
+      if (sleep_time > 0) Sleep(sleep_time);
+    }
+    timediff = (int)(GetTickCount64() - start);
+  }
+}
+
+
 /* --- process::close_input ----------------------------------------- */
 
 void process_handle_t::close_input ()
@@ -445,6 +711,107 @@ void process_handle_t::close_input ()
 }
 
 
+/* --- process::communicate ----------------------------------------- */
+
+struct input_feed {
+  HANDLE pipe;
+  const input_buffer * buffers;
+  size_t count;
+  DWORD error;
+};
+
+
+/* writes block, so input is fed from a separate thread */
+static DWORD WINAPI feed_input (LPVOID _param)
+{
+  input_feed * feed = static_cast<input_feed *>(_param);
+
+  for (size_t i = 0; i < feed->count; ++i) {
+    const char * buffer = feed->buffers[i].data;
+    size_t left = feed->buffers[i].length;
+
+    while (left > 0) {
+      DWORD written = 0;
+      DWORD length = (DWORD)std::min<size_t>(left, 1024 * 1024);
+      if (!::WriteFile(feed->pipe, buffer, length, &written, NULL)) {
+        DWORD error = ::GetLastError();
+        // the child closed its input and does not want the rest of it
+        if (error != ERROR_NO_DATA && error != ERROR_BROKEN_PIPE) {
+          feed->error = error;
+        }
+        return 0;
+      }
+      buffer += written;
+      left -= written;
+    }
+  }
+
+  return 0;
+}
+
+
+void process_handle_t::communicate (const input_buffer * _input, size_t _count, int _timeout, bool _binary)
+{
+  if (_count && pipe_stdin == HANDLE_CLOSED) {
+    throw subprocess_exception(EALREADY, "child's standard input already closed");
+  }
+
+  // output accumulates; it is handed over to R only at the end
+  stdout_.clear();
+  stderr_.clear();
+
+  input_feed feed = { pipe_stdin, _input, _count, 0 };
+  HANDLE feeder = NULL;
+  if (_count) {
+    feeder = ::CreateThread(NULL, 0, feed_input, &feed, 0, NULL);
+    if (!feeder) {
+      throw subprocess_exception(::GetLastError(), "could not start input thread");
+    }
+  }
+
+  ULONGLONG start = GetTickCount64();
+  int timediff = 0;
+
+  while (true) {
+    if (feeder && ::WaitForSingleObject(feeder, 0) == WAIT_OBJECT_0) {
+      ::CloseHandle(feeder);
+      feeder = NULL;
+    }
+    if (!feeder && pipe_stdin != HANDLE_CLOSED) {
+      CloseHandle(pipe_stdin);
+    }
+
+    size_t rc1 = stdout_.read(pipe_stdout, false, true);
+    size_t rc2 = stderr_.read(pipe_stderr, false, true);
+
+    if (!feeder && stdout_.eof && stderr_.eof) {
+      break;
+    }
+
+    timediff = (int)(GetTickCount64() - start);
+    if (_timeout >= 0 && timediff >= _timeout) {
+      break;
+    }
+    if (!rc1 && !rc2) {
+      Sleep(10);
+    }
+  }
+
+  // out of time: unblock the writer; the rest of input is discarded
+  if (feeder) {
+    ::CancelSynchronousIo(feeder);
+    ::WaitForSingleObject(feeder, INFINITE);
+    ::CloseHandle(feeder);
+  }
+
+  if (feed.error) {
+    throw subprocess_exception(feed.error, "could not write to child process");
+  }
+
+  wait(_timeout < 0 ? TIMEOUT_INFINITE : std::max(0, _timeout - timediff));
+}
+
+
 /* ------------------------------------------------------------------ */
 
 
@@ -566,6 +933,81 @@ void process_handle_t::send_signal (int _signal)
 }
 
 
+bool fork_server_start ()
+{
+  throw subprocess_exception(ERROR_NOT_SUPPORTED, "fork server is not supported in Windows");
+}
+
+bool fork_server_stop () { return false; }
+
+bool fork_server_running () { return false; }
+
+
+size_t poll_processes (process_handle_t * const * _handles, size_t _count,
+                       int _timeout, size_t * _ready)
+{
+  throw subprocess_exception(ERROR_NOT_SUPPORTED, "polling multiple processes is not supported in Windows");
+}
+
+
+void spawn_pipeline (process_handle_t * const * _handles, size_t _count,
+                     const char * const * _commands, char ** const * _arguments,
+                     char *const _environment[], const char * _workdir,
+                     process_handle_t::termination_mode_type _termination_mode,
+                     const spawn_options & _options)
+{
+  throw subprocess_exception(ERROR_NOT_SUPPORTED, "pipelines are not supported in Windows");
+}
+
+
+void run_parallel (size_t _count, const char * const * _commands, char ** const * _arguments,
+                   char *const _environment[], const char * _workdir,
+                   process_handle_t::termination_mode_type _termination_mode,
+                   const spawn_options & _options, size_t _max_jobs, int _timeout,
+                   job_result * _results)
+{
+  throw subprocess_exception(ERROR_NOT_SUPPORTED, "running commands in parallel is not supported in Windows");
+}
+
+
+process_pool::process_pool (const char * _command, char *const _arguments[], char *const _environment[],
+                            const char * _workdir, process_handle_t::termination_mode_type _termination_mode,
+                            const spawn_options & _options, size_t _size, protocol_type _protocol,
+                            size_t _inflight)
+  : impl(nullptr)
+{
+  throw subprocess_exception(ERROR_NOT_SUPPORTED, "process pools are not supported in Windows");
+}
+
+process_pool::~process_pool () { }
+
+void process_pool::submit (const input_buffer * _requests, size_t _count, uint64_t * _ids) { }
+
+size_t process_pool::collect (vector<result> & _results, size_t _max, int _timeout) { return 0; }
+
+process_pool::statistics process_pool::stats () { return statistics(); }
+
+size_t process_pool::restart () { return 0; }
+
+
+event_watcher::event_watcher () : impl(nullptr)
+{
+  throw subprocess_exception(ERROR_NOT_SUPPORTED, "watching children from the event loop is not supported in Windows");
+}
+
+event_watcher::~event_watcher () { }
+
+int event_watcher::fd () const { return -1; }
+
+void event_watcher::watch_output (process_handle_t & _handle, pipe_type _pipes) { }
+
+void event_watcher::watch_exit (process_handle_t & _handle) { }
+
+void event_watcher::forget (process_handle_t & _handle, pipe_type _pipes, bool _exit) { }
+
+void event_watcher::ready (vector<event> & _events) { _events.clear(); }
+
+
 bool process_exists (const pid_type & _pid) {
   /*
    * https://stackoverflow.com/questions/12900036/benefit-of-using-waitforsingleobject-when-checking-process-id
@@ -6,7 +6,18 @@
 
 #include "subprocess.h"
 
+#include <cstdint>
 #include <cstdlib>
+#include <regex>
+
+#ifndef SUBPROCESS_WINDOWS
+#include <langinfo.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SUBPROCESS_X86_DISPATCH
+#include <immintrin.h>
+#endif
 
 #define MB_PARSE_ERROR ((size_t)-1)
 #define MB_INCOMPLETE  ((size_t)-2)
@@ -16,46 +27,226 @@
 namespace subprocess {
 
 
-size_t pipe_writer::read (pipe_handle_type _fd, bool _mbcslocale) {
-  if (_mbcslocale) {
-    memcpy(contents.data(), left.data, left.len);
+size_t pipe_writer::read (pipe_handle_type _fd, bool _mbcslocale, bool _flush, bool _drain)
+{
+  // new data is appended after bytes carried over from the last read
+  size_t start = length, end = length + carry;
+
+  while (true) {
+    // make sure there is a reasonable amount of space for the next read
+    if (contents.size() - end < read_size) {
+      contents.resize(std::max(contents.size() * 2, end + read_size));
+    }
+
+    size_t free_space = contents.size() - end;
+    size_t rc = os_read(_fd, contents.data() + end, free_space);
+    end += rc;
+
+    if (eof || (_drain && rc == 0)) {
+      break;
+    }
+
+    // a short read means the pipe has been emptied
+    if (!_drain && (!_flush || rc < free_space)) {
+      break;
+    }
+  }
+
+  return verify(start, end, _mbcslocale);
+}
+
+
+size_t pipe_writer::append (container_type & _data, bool _mbcslocale)
+{
+  size_t start = length, end = length + carry;
+
+  // an empty buffer can simply take over the memory block
+  if (end == 0) {
+    contents.swap(_data);
+    end = contents.size();
   }
   else {
-    left.len = 0;
+    contents.resize(std::max(contents.size(), end + _data.size()));
+    memcpy(contents.data() + end, _data.data(), _data.size());
+    end += _data.size();
   }
-  
-  size_t rc = os_read(_fd);
 
-  // end with 0 to make sure R can create a string out of the data block
-  rc += left.len;
-  contents[rc] = 0;
+  _data.clear();
+  return verify(start, end, _mbcslocale);
+}
+
 
+size_t pipe_writer::verify (size_t _start, size_t _end, bool _mbcslocale)
+{
   // if there is a partial multi-byte character at the end, keep
   // it around for the next read attempt
   if (_mbcslocale) {
-    left.len = 0;
-    
-    // check if all bytes are correct UTF8 content
-    size_t consumed = consume_utf8(contents.data(), rc);
-    if (consumed == MB_PARSE_ERROR || (rc - consumed > 4)) {
+    // check if all new bytes are correct UTF8 content
+    size_t consumed = consume_utf8(contents.data() + _start, _end - _start);
+    if (consumed == MB_PARSE_ERROR || (_end - _start - consumed > 4)) {
       throw subprocess_exception(EIO, "malformed multibyte string");
     }
-    if (consumed < (size_t)rc) {
-      left.len = rc-consumed;
-      memcpy(left.data, contents.data()+consumed, left.len);
-      contents[consumed] = 0;
-      rc = consumed;
+    length = _start + consumed;
+  }
+  else {
+    length = _end;
+  }
+
+  carry = _end - length;
+  return length - _start;
+}
+
+
+/* --- process_handle_t --------------------------------------------- */
+
+void process_handle_t::open_tees (const spawn_options & _options)
+{
+  output_tee * tees[3]     = { nullptr, &stdout_tee, &stderr_tee };
+  pipe_writer * writers[3] = { nullptr, &stdout_, &stderr_ };
+
+  for (int i = PIPE_STDOUT; i <= PIPE_STDERR; ++i) {
+    if (!_options.tee_path[i]) continue;
+    if (!_options.piped(i)) {
+      throw subprocess_exception(EINVAL, "only output read by R can be copied to a log file");
     }
+    tees[i]->open(_options.tee_path[i], _options.tee_append[i]);
+    writers[i]->tee = tees[i];
+  }
+}
+
+
+/* --- output_matcher ----------------------------------------------- */
+
+struct output_matcher::compiled {
+  std::regex expression;
+};
+
+
+output_matcher::output_matcher (const string & _pattern, bool _fixed)
+  : pattern(_pattern), regex(nullptr), searched(0)
+{
+  if (_fixed) return;
+
+  try {
+    regex = new compiled{ std::regex(_pattern, std::regex::extended) };
   }
+  catch (std::regex_error & e) {
+    throw subprocess_exception(EINVAL, string("invalid regular expression: ") + e.what());
+  }
+}
+
 
-  return rc;
+output_matcher::~output_matcher ()
+{
+  delete regex;
 }
 
 
-static int min (int a, int b) { return a<b ? a : b; }
+static const char * find_fixed (const char * _data, size_t _length, const string & _pattern)
+{
+#ifdef SUBPROCESS_WINDOWS
+  const char * end = _data + _length;
+  const char * found = std::search(_data, end, _pattern.begin(), _pattern.end());
+  return found == end ? nullptr : found;
+#else
+  // Two-Way in glibc: linear and without a per-call table
+  return (const char *)memmem(_data, _length, _pattern.data(), _pattern.size());
+#endif
+}
 
 
-size_t consume_utf8 (const char * _input, size_t _length)
+size_t output_matcher::find (const char * _data, size_t _length)
+{
+  size_t start = 0;
+
+  if (!regex) {
+    // a match can begin in the last `size - 1` bytes searched before
+    if (searched >= pattern.size()) {
+      start = searched - pattern.size() + 1;
+    }
+    searched = _length;
+
+    const char * found = find_fixed(_data + start, _length - start, pattern);
+    return found ? static_cast<size_t>(found - _data) + pattern.size() : npos;
+  }
+
+  // new data can only extend the last line searched before
+  start = std::min(searched, _length);
+  while (start > 0 && _data[start - 1] != '\n') --start;
+  searched = _length;
+
+  while (start < _length) {
+    const char * line = _data + start;
+    const char * eol = (const char *)memchr(line, '\n', _length - start);
+    size_t line_length = eol ? static_cast<size_t>(eol - line) : _length - start;
+
+    std::cmatch match;
+    if (std::regex_search(line, line + line_length, match, regex->expression)) {
+      // a match which ends a line takes the new line with it
+      size_t end = match.position(0) + match.length(0);
+      return start + end + (eol && end == line_length ? 1 : 0);
+    }
+
+    if (!eol) break;
+    start += line_length + 1;
+  }
+
+  return npos;
+}
+
+
+/* --- shell session ------------------------------------------------ */
+
+int shell_run (process_handle_t & _handle, const string & _command, const string & _marker,
+               int _timeout, bool _binary)
+{
+  if (_marker.empty() || _marker.find_first_not_of(
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != string::npos)
+  {
+    throw subprocess_exception(EINVAL, "invalid command marker");
+  }
+
+  // quoted for eval, an unfinished quote or block in the command cannot
+  // swallow the markers; each marker starts a new line, which is then
+  // cut off together with it, so output keeps its last line as printed
+  string script = "eval '";
+  script.reserve(_command.size() + 2 * _marker.size() + 96);
+  for (char c : _command) {
+    if (c == '\'') script += "'\\''"; else script += c;
+  }
+  script += "' </dev/null\nprintf '\\n%d %s\\n' $? " + _marker +
+            "; printf '\\n %s\\n' " + _marker + " >&2\n";
+
+  input_buffer input = { script.data(), script.size() };
+  _handle.write(&input, 1, TIMEOUT_IMMEDIATE);
+
+  string tail = " " + _marker + "\n";
+  output_matcher out(tail, true), err(tail, true);
+  if (!_handle.read_until(&out, &err, _timeout, _binary)) {
+    return -1;
+  }
+
+  int status = -1;
+  pipe_writer * writers[2] = { &_handle.stdout_, &_handle.stderr_ };
+  for (pipe_writer * writer : writers) {
+    const char * begin = writer->data();
+    const char * line  = begin + writer->size() - tail.size();
+    while (line > begin && line[-1] != '\n') --line;
+
+    if (writer == &_handle.stdout_) {
+      status = static_cast<int>(strtol(line, nullptr, 10));
+    }
+    size_t cut = (line > begin) ? static_cast<size_t>(line - begin) - 1 : 0;
+    writer->discard(writer->size() - cut);
+  }
+
+  return status;
+}
+
+
+/* --- UTF-8 verification --------------------------------------------- */
+
+size_t consume_mbrtowc (const char * _input, size_t _length)
 {
   wchar_t wc;
   size_t used, consumed = 0;
@@ -65,7 +256,7 @@ size_t consume_utf8 (const char * _input, size_t _length)
 
   // if used > 0 we can just skip that many bytes and move on  
   while (_length > consumed) {
-    used = mbrtowc(&wc, _input, min(MB_CUR_MAX, _length-consumed), &mb_st);
+    used = mbrtowc(&wc, _input, std::min<size_t>(MB_CUR_MAX, _length-consumed), &mb_st);
     // two situations when an error in encountered
     if (used == MB_INCOMPLETE) {
       return consumed;
@@ -73,15 +264,203 @@ size_t consume_utf8 (const char * _input, size_t _length)
     if (used == MB_PARSE_ERROR) {
       return MB_PARSE_ERROR;
     }
+    // a NUL byte is reported as zero bytes; it is dropped when the
+    // output is split into lines
+    if (!used) {
+      used = 1;
+    }
     // correctly consumed multi-byte character
-    if (used) {
-      _input   += used;
-      consumed += used;
+    _input   += used;
+    consumed += used;
+  }
+
+  return consumed;
+}
+
+
+/*
+ * Is the current locale's character set UTF-8? Checked on every call
+ * because R can change the locale at any time.
+ */
+static bool is_utf8_locale ()
+{
+#ifdef SUBPROCESS_WINDOWS
+  return false;
+#else
+  const char * codeset = nl_langinfo(CODESET);
+  return codeset && (!strcmp(codeset, "UTF-8") || !strcmp(codeset, "utf8"));
+#endif
+}
+
+
+/*
+ * Find the first byte which is either 0 or not an ASCII character,
+ * eight bytes at a time.
+ */
+static size_t skip_ascii_word (const char * _input, size_t _length)
+{
+  const uint64_t high = 0x8080808080808080ULL, ones = 0x0101010101010101ULL;
+  size_t i = 0;
+
+  for ( ; i + 8 <= _length; i += 8) {
+    uint64_t word;
+    memcpy(&word, _input + i, sizeof(word));
+    // high bit set in any byte, or any byte equal to zero
+    if ((word & high) || ((word - ones) & ~word & high)) break;
+  }
+
+  for ( ; i < _length; ++i) {
+    unsigned char c = (unsigned char)_input[i];
+    if (c == 0 || c >= 0x80) break;
+  }
+
+  return i;
+}
+
+
+#ifdef SUBPROCESS_X86_DISPATCH
+
+__attribute__((target("sse2")))
+static size_t skip_ascii_sse2 (const char * _input, size_t _length)
+{
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for ( ; i + 16 <= _length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(_input + i));
+    // movemask picks the high bit, that is non-ASCII bytes
+    int mask = _mm_movemask_epi8(chunk) | _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+
+  return i + skip_ascii_word(_input + i, _length - i);
+}
+
+__attribute__((target("avx2")))
+static size_t skip_ascii_avx2 (const char * _input, size_t _length)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for ( ; i + 32 <= _length; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(_input + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(chunk) |
+                    (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, zero));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+
+  return i + skip_ascii_sse2(_input + i, _length - i);
+}
+
+#endif /* SUBPROCESS_X86_DISPATCH */
+
+
+typedef size_t (* skip_ascii_type)(const char *, size_t);
+
+/*
+ * Choose the widest implementation the CPU supports.
+ */
+static skip_ascii_type select_skip_ascii ()
+{
+#ifdef SUBPROCESS_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return &skip_ascii_avx2;
+  if (__builtin_cpu_supports("sse2")) return &skip_ascii_sse2;
+#endif
+  return &skip_ascii_word;
+}
+
+
+/*
+ * Well-formed UTF-8 sequences (The Unicode Standard, Table 3-7): for
+ * each leading byte the length of the sequence and the range of the
+ * second byte; all following bytes are in 0x80..0xBF. Length 0 means
+ * the byte cannot start a well-formed sequence.
+ */
+struct utf8_lead {
+  unsigned char length, low, high;
+};
+
+struct utf8_lead_table {
+  utf8_lead leads[256];
+
+  utf8_lead_table () {
+    for (int c = 0; c < 256; ++c) {
+      utf8_lead lead = { 0, 0x80, 0xBF };
+      if (c >= 0xC2 && c <= 0xDF) lead.length = 2;
+      if (c >= 0xE0 && c <= 0xEF) lead.length = 3;
+      if (c >= 0xF0 && c <= 0xF4) lead.length = 4;
+      if (c == 0xE0) lead.low  = 0xA0;
+      if (c == 0xED) lead.high = 0x9F;
+      if (c == 0xF0) lead.low  = 0x90;
+      if (c == 0xF4) lead.high = 0x8F;
+      leads[c] = lead;
     }
-    // zero bytes consumed
-    else {
-      break;
+  }
+};
+
+
+/*
+ * Length of a well-formed multi-byte character at the beginning of
+ * `_input` or 0 if the sequence is not well-formed or not complete.
+ */
+static size_t utf8_sequence (const utf8_lead * _leads, const unsigned char * _input, size_t _length)
+{
+  const utf8_lead & lead = _leads[_input[0]];
+  if (!lead.length || lead.length > _length) return 0;
+  if (_input[1] < lead.low || _input[1] > lead.high) return 0;
+
+  for (size_t i = 2; i < lead.length; ++i) {
+    if ((_input[i] & 0xC0) != 0x80) return 0;
+  }
+
+  return lead.length;
+}
+
+
+/*
+ * In UTF-8 locales ASCII runs are skipped with vector instructions and
+ * well-formed multi-byte characters are verified with a lookup table.
+ * Anything else - NUL, an ill-formed or an incomplete sequence - is
+ * passed to mbrtowc(), one character at a time, so that the result is
+ * always the same as the one of consume_mbrtowc().
+ */
+size_t consume_utf8 (const char * _input, size_t _length)
+{
+  if (!is_utf8_locale()) {
+    return consume_mbrtowc(_input, _length);
+  }
+
+  static const skip_ascii_type skip_ascii = select_skip_ascii();
+  static const utf8_lead_table table;
+  const utf8_lead * leads = table.leads;
+  const unsigned char * input = (const unsigned char *)_input;
+  size_t consumed = 0;
+
+  while (consumed < _length) {
+    consumed += skip_ascii(_input + consumed, _length - consumed);
+    if (consumed == _length) break;
+
+    size_t used = utf8_sequence(leads, input + consumed, _length - consumed);
+    if (!used) {
+      // back to the fast path right after this character
+      wchar_t wc;
+      mbstate_t mb_st = { };
+      used = mbrtowc(&wc, _input + consumed,
+                     std::min<size_t>(MB_CUR_MAX, _length - consumed), &mb_st);
+      if (used == MB_INCOMPLETE) {
+        return consumed;
+      }
+      if (used == MB_PARSE_ERROR) {
+        return MB_PARSE_ERROR;
+      }
+      // NUL
+      if (!used) {
+        used = 1;
+      }
     }
+
+    consumed += used;
   }
 
   return consumed;
@@ -17,6 +17,9 @@
 #include <cerrno>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -45,6 +48,8 @@ string strerror (int _code, const string & _message);
 
 size_t consume_utf8 (const char * _input, size_t _length);
 
+size_t consume_mbrtowc (const char * _input, size_t _length);
+
 
 /**
  * A simple exception class.
@@ -77,68 +82,230 @@ struct subprocess_exception : runtime_error {
 
 
 
+/**
+ * Looks for a fixed string or a regular expression in output as it
+ * accumulates. Each call to find() examines only data which arrived
+ * since the previous call together with the part of older data a
+ * match could start in: the last `pattern length - 1` bytes for a
+ * fixed string, the last unfinished line for a regular expression.
+ * Regular expressions (POSIX extended) are matched line by line.
+ */
+struct output_matcher {
+
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  output_matcher (const string & _pattern, bool _fixed);
+
+  ~output_matcher ();
+
+  output_matcher (const output_matcher &) = delete;
+  output_matcher & operator = (const output_matcher &) = delete;
+
+  /** Start over with a new buffer. */
+  void reset () { searched = 0; }
+
+  /**
+   * Search `_length` bytes of `_data` whose first bytes, up to the
+   * length given in the previous call, have been searched already.
+   *
+   * @return Offset just past the first match or npos.
+   */
+  size_t find (const char * _data, size_t _length);
+
+private:
+
+  struct compiled;
+
+  string pattern;
+  compiled * regex;
+  size_t searched;
+};
+
+
+/**
+ * A log file which receives a copy of everything read from a child's
+ * output pipe. Data is written to the file right after it is read,
+ * before it is handed over to R, so the file holds all output R has
+ * seen even if R fails afterwards.
+ */
+struct output_tee {
+
+  pipe_handle_type file;
+
+  /** Error code of the first failed copy; copying stops there. */
+  std::atomic<int> error;
+
+  /** The error has been reported to the user. */
+  bool reported;
+
+  output_tee ();
+
+  ~output_tee () { close(); }
+
+  /** Open or create the log file. */
+  void open (const char * _path, bool _append);
+
+  void close ();
+
+  /**
+   * Copy `_length` bytes just read from the pipe.
+   */
+  void write (const char * _buffer, size_t _length);
+};
+
+
 /**
  * Buffer for a single output stream.
  *
  * This buffer comes with additional logic of handling a number of
  * bytes left from the previous read that did not constitute a
- * correct multi-byte character.
+ * correct multi-byte character. Those bytes are kept right after the
+ * data handed over to R and are moved to the front of the buffer
+ * when it is cleared before the next read.
+ *
+ * The buffer grows geometrically so that a single native call can
+ * drain all data available in the pipe.
  */
 struct pipe_writer {
 
+  /** Initial capacity and the minimum free space for a single read. */
   static constexpr size_t buffer_size = 1024;
 
-  struct leftover {
-    leftover () : len(0) { }
-    size_t len;
-    char data[4];
-
-    static_assert(sizeof(pipe_writer::leftover::data) < buffer_size,
-                  "buffer too small for multi-byte char support");
-  };
+  /** Capacity above which an empty buffer is shrunk in clear(). */
+  static constexpr size_t max_idle_size = 1024 * 1024;
 
   typedef vector<char> container_type;
 
   container_type contents;
-  leftover left;
+
+  /** Number of bytes ready to be handed over to R. */
+  size_t length;
+
+  /** Number of bytes following `length` kept for the next read. */
+  size_t carry;
+
+  /** Leading part of `carry` handed back with keep(). */
+  size_t checked;
+
+  /** The writing end has been closed and all data has been read. */
+  bool eof;
+
+  /** Receives a copy of all data read; not owned, can be null. */
+  output_tee * tee;
 
   /**
-   * Throws if buffer is too small.
+   * Free space made available for a single read: the capacity of the
+   * pipe, so that a full pipe is drained with one system call.
    */
-  pipe_writer () : contents(buffer_size, 0) { }
+  size_t read_size;
+
+  pipe_writer ()
+    : contents(buffer_size, 0), length(0), carry(0), checked(0), eof(false), tee(nullptr),
+      read_size(buffer_size)
+  { }
 
   const container_type::value_type * data () const { return contents.data(); }
 
-  void clear () { contents[0] = 0; }
+  size_t size () const { return length; }
+
+  /**
+   * Hand the last `_count` bytes back to the buffer; they will be
+   * returned again, preceding new data, after the next read. This is
+   * used to carry an incomplete line over to the next read.
+   */
+  void keep (size_t _count)
+  {
+    length  -= _count;
+    carry   += _count;
+    checked += _count;
+  }
+
+  /**
+   * Remove the last `_count` bytes of data ready to be handed over to
+   * R; bytes kept for the next read stay where they are.
+   */
+  void discard (size_t _count)
+  {
+    memmove(contents.data() + length - _count, contents.data() + length, carry);
+    length -= _count;
+  }
+
+  /**
+   * Drop data already handed over to R and move the bytes carried
+   * over from the previous read to the front of the buffer. The part
+   * that has been verified is immediately ready to be handed over
+   * again.
+   */
+  void clear ()
+  {
+    if (length > 0 && carry > 0) {
+      memmove(contents.data(), contents.data() + length, carry);
+    }
+    length  = checked;
+    carry  -= checked;
+    checked = 0;
+
+    if (contents.size() > max_idle_size + read_size && length + carry < read_size) {
+      container_type smaller(read_size, 0);
+      memcpy(smaller.data(), contents.data(), length + carry);
+      contents.swap(smaller);
+    }
+  }
 
-  size_t os_read (pipe_handle_type _pipe)
+  /**
+   * Read at most `_length` bytes from pipe. Sets `eof` when the pipe
+   * has been closed on the other side.
+   *
+   * @return Number of bytes read; 0 if there is no data available.
+   */
+  size_t os_read (pipe_handle_type _pipe, char * _buffer, size_t _length)
   {
-    char * buffer = contents.data() + left.len;
-    size_t length = contents.size() - left.len - 1;
+    // stream redirected away from R when the child was spawned
+    if (_pipe == HANDLE_CLOSED) {
+      eof = true;
+      return 0;
+    }
 
 #ifdef SUBPROCESS_WINDOWS
     DWORD dwAvail = 0, nBytesRead;
 
     // if returns FALSE and error is "broken pipe", pipe is gone
     if (!::PeekNamedPipe(_pipe, NULL, 0, NULL, &dwAvail, NULL)) {
-      if (::GetLastError() == ERROR_BROKEN_PIPE) return 0;
+      if (::GetLastError() == ERROR_BROKEN_PIPE) {
+        eof = true;
+        return 0;
+      }
       throw subprocess_exception(::GetLastError(), "could not peek into pipe");
     }
 
     if (dwAvail == 0)
       return 0;
 
-    dwAvail = std::min((size_t)dwAvail, length);
-    if (!::ReadFile(_pipe, buffer, dwAvail, &nBytesRead, NULL)) {
+    dwAvail = (DWORD)std::min((size_t)dwAvail, _length);
+    if (!::ReadFile(_pipe, _buffer, dwAvail, &nBytesRead, NULL)) {
       throw subprocess_exception(::GetLastError(), "could not read from pipe");
     }
+    if (tee) {
+      tee->write(_buffer, nBytesRead);
+    }
 
     return static_cast<size_t>(nBytesRead);
 #else /* SUBPROCESS_WINDOWS */
-    int rc = ::read(_pipe, buffer, length);
+    ssize_t rc;
+    do {
+      rc = ::read(_pipe, _buffer, _length);
+    } while (rc < 0 && errno == EINTR);
+
     if (rc < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
       throw subprocess_exception(errno, "could not read from pipe");
     }
+    if (rc == 0 && _length > 0) {
+      eof = true;
+    }
+    if (rc > 0 && tee) {
+      tee->write(_buffer, rc);
+    }
     return static_cast<size_t>(rc);
 #endif /* SUBPROCESS_WINDOWS */
   }
@@ -147,20 +314,287 @@ struct pipe_writer {
   /**
    * Read from pipe.
    *
-   * Will accommodate for previous leftover and will keep a single
-   * byte to store 0 at the end of the input data. That guarantees
-   * that R string can be correctly constructed from buffer's data
-   * (R expects a ZERO at the end).
+   * Will accommodate for previous leftover and append new data after
+   * it. Only the newly read part is verified when in a multi-byte
+   * locale.
    *
    * @param _fd Input pipe handle.
    * @param _mbcslocale Is this multi-byte character set? If so, verify
    *        string integrity after a successful read.
+   * @param _flush If true, keep reading and growing the buffer until
+   *        the pipe is empty.
+   * @param _drain If true, keep reading until the end of stream; used
+   *        when the writing end is known to be closed.
+   * @return Number of new bytes ready to be handed over to R.
    */
-  size_t read (pipe_handle_type _fd, bool _mbcslocale = false);
+  size_t read (pipe_handle_type _fd, bool _mbcslocale = false, bool _flush = false,
+               bool _drain = false);
+
+  /**
+   * Append data collected elsewhere, e.g. by a background reader.
+   *
+   * If this buffer is empty, the memory block is swapped rather than
+   * copied. `_data` is always left empty.
+   *
+   * @return Number of new bytes ready to be handed over to R.
+   */
+  size_t append (container_type & _data, bool _mbcslocale = false);
+
+private:
+
+  /**
+   * Verify bytes from `_start` to `_end` and set `length` and
+   * `carry` accordingly.
+   */
+  size_t verify (size_t _start, size_t _end, bool _mbcslocale);
 
 }; /* pipe_writer */
 
 
+/**
+ * A piece of input for process_handle_t::write(); memory is owned by
+ * the caller.
+ */
+struct input_buffer {
+  const char * data;
+  size_t length;
+};
+
+
+/**
+ * Input accepted by process_handle_t::write() or write_file() but not
+ * yet taken by the child. It is written out whenever the pipe becomes
+ * writable while R reads, polls or waits.
+ *
+ * Memory is kept in blocks freed as soon as they are written; a part
+ * of a file is kept as an open descriptor and its contents are moved
+ * into the pipe by the kernel.
+ */
+struct input_queue {
+
+  /* new data is appended to the last block until it reaches this size */
+  static constexpr size_t block_size = 64 * 1024;
+
+  struct chunk {
+    /** Memory block. */
+    vector<char> data;
+
+    /** Bytes at the front of `data` which have already been written. */
+    size_t offset;
+
+    /** Open file, or -1 for a memory block. */
+    int fd;
+
+    /** Position in the file of the next byte to write. */
+    int64_t position;
+
+    /** Bytes of the file still to write. */
+    size_t length;
+
+    chunk (int _fd = -1, int64_t _position = 0, size_t _length = 0)
+      : offset(0), fd(_fd), position(_position), length(_length) { }
+
+    size_t size () const { return fd < 0 ? data.size() - offset : length; }
+  };
+
+  std::deque<chunk> chunks;
+
+  /** Bytes in all chunks. */
+  size_t total;
+
+  /** Close the pipe once the queue is empty. */
+  bool close_pending;
+
+  input_queue () : total(0), close_pending(false) { }
+
+  ~input_queue () { clear(); }
+
+  size_t size () const { return total; }
+
+  chunk & front () { return chunks.front(); }
+
+  void push (const char * _data, size_t _length)
+  {
+    if (!_length) return;
+    if (chunks.empty() || chunks.back().fd >= 0 || chunks.back().data.size() >= block_size) {
+      chunks.push_back(chunk());
+    }
+    vector<char> & data = chunks.back().data;
+    data.insert(data.end(), _data, _data + _length);
+    total += _length;
+  }
+
+  /** Takes over `_fd`, which is closed once the part has been written. */
+  void push_file (int _fd, int64_t _position, size_t _length)
+  {
+    chunks.push_back(chunk(_fd, _position, _length));
+    total += _length;
+  }
+
+  /** `_length` bytes at the front have been written. */
+  void pop (size_t _length)
+  {
+    chunk & first = chunks.front();
+    if (first.fd < 0) {
+      first.offset += _length;
+    }
+    else {
+      first.position += _length;
+      first.length -= _length;
+    }
+    total -= _length;
+
+    if (!first.size()) {
+      drop();
+    }
+  }
+
+  /** Drop the first chunk, written or not, e.g. a file which ended early. */
+  void drop ()
+  {
+    chunk & first = chunks.front();
+    total -= first.size();
+#ifndef SUBPROCESS_WINDOWS
+    if (first.fd >= 0) ::close(first.fd);
+#endif
+    chunks.pop_front();
+  }
+
+  void clear ()
+  {
+    while (!chunks.empty()) {
+      drop();
+    }
+  }
+};
+
+
+/**
+ * Options which control how a child process is spawned and how its
+ * output is handled.
+ */
+struct spawn_options {
+
+  /* what to do with output when the background buffer is full */
+  enum overflow_policy_type { OVERFLOW_BLOCK, OVERFLOW_DROP };
+
+  /* how the child process is created */
+  enum engine_type { ENGINE_AUTO, ENGINE_FORK, ENGINE_POSIX_SPAWN, ENGINE_FORK_SERVER };
+
+  /* what a child's standard stream is connected to */
+  enum redirect_type { REDIRECT_PIPE, REDIRECT_NULL, REDIRECT_INHERIT, REDIRECT_FILE, REDIRECT_STDOUT,
+                       REDIRECT_FD };
+
+  /** Drain stdout and stderr in a background thread. */
+  bool background_reader;
+
+  /** Maximum number of bytes buffered for each output stream. */
+  size_t buffer_limit;
+
+  overflow_policy_type overflow_policy;
+
+  /** ENGINE_AUTO picks the cheapest engine which supports all options. */
+  engine_type engine;
+
+  /**
+   * Descriptors inherited by the child; all others but the standard
+   * streams are closed. Not owned, must outlive spawn().
+   */
+  const int * keep_fds;
+  size_t keep_fds_count;
+
+  /**
+   * Where child's standard streams are connected, indexed with
+   * PIPE_STDIN, PIPE_STDOUT, PIPE_STDERR. A pipe is created only for
+   * REDIRECT_PIPE; REDIRECT_STDOUT is valid only for stderr.
+   */
+  redirect_type redirect[3];
+
+  /** File names for REDIRECT_FILE. Not owned, must outlive spawn(). */
+  const char * redirect_path[3];
+
+  /** Append to rather than truncate an output file. */
+  bool redirect_append[3];
+
+  /** Descriptors for REDIRECT_FD; not owned. */
+  pipe_handle_type redirect_fd[3];
+
+  /**
+   * For REDIRECT_FD: R's end of a pipe whose other end is
+   * `redirect_fd`, or HANDLE_CLOSED. It is used as if spawn() created
+   * the pipe; the handle takes it over once the child is running.
+   */
+  pipe_handle_type redirect_peer[3];
+
+  /**
+   * Log files which receive a copy of piped stdout and stderr, or
+   * null; the stdin entry is not used. Not owned, must outlive spawn().
+   */
+  const char * tee_path[3];
+
+  /** Append to rather than truncate a log file. */
+  bool tee_append[3];
+
+  /** Requested capacity of each pipe in bytes; 0 keeps the default. */
+  size_t pipe_size[3];
+
+  spawn_options ()
+    : background_reader(false), buffer_limit(16 * 1024 * 1024),
+      overflow_policy(OVERFLOW_BLOCK), engine(ENGINE_AUTO),
+      keep_fds(nullptr), keep_fds_count(0),
+      redirect{ REDIRECT_PIPE, REDIRECT_PIPE, REDIRECT_PIPE },
+      redirect_path{ nullptr, nullptr, nullptr },
+      redirect_append{ false, false, false },
+      redirect_fd{ HANDLE_CLOSED, HANDLE_CLOSED, HANDLE_CLOSED },
+      redirect_peer{ HANDLE_CLOSED, HANDLE_CLOSED, HANDLE_CLOSED },
+      tee_path{ nullptr, nullptr, nullptr },
+      tee_append{ false, false, false },
+      pipe_size{ 0, 0, 0 }
+  { }
+
+  /** R has its end of `_stream`: a pipe. */
+  bool piped (int _stream) const
+  {
+    return redirect[_stream] == REDIRECT_PIPE ||
+           (redirect[_stream] == REDIRECT_FD && redirect_peer[_stream] != HANDLE_CLOSED);
+  }
+};
+
+
+/* defined in the OS-specific part */
+struct background_reader;
+
+
+/**
+ * Readiness of a process handle as seen by poll_processes(). Flags
+ * are sticky: data flags are cleared only when output is read from
+ * the corresponding pipe.
+ */
+struct poll_state {
+
+  enum flag_type { STDOUT_DATA = 1, STDERR_DATA = 2, STDOUT_EOF = 4, STDERR_EOF = 8 };
+
+  unsigned flags;
+
+  /* output pipes are registered with the shared poller */
+  bool registered;
+
+  /* end of output has already been reported once */
+  bool eof_reported;
+
+  /* the last call to poll_processes() which included this handle */
+  unsigned long round;
+  size_t index;
+
+  poll_state ()
+    : flags(0), registered(false), eof_reported(false), round(0), index(0)
+  { }
+
+  bool data () const { return (flags & (STDOUT_DATA | STDERR_DATA)) != 0; }
+  bool eof () const { return (flags & STDOUT_EOF) && (flags & STDERR_EOF); }
+};
+
+
 /**
  * Check if process with given pid exists.
  *
@@ -194,6 +628,11 @@ struct process_handle_t {
                    pipe_stdout,
                    pipe_stderr;
 
+#ifndef SUBPROCESS_WINDOWS
+  /* readable once the child exits; HANDLE_CLOSED without pidfd support */
+  int pid_fd;
+#endif
+
   // platform-independent process data
   int child_id;
   process_state_type state;
@@ -205,6 +644,24 @@ struct process_handle_t {
   /* stdout & stderr handling */
   pipe_writer stdout_, stderr_;
 
+  /* copies of stdout & stderr, if requested in spawn options */
+  output_tee stdout_tee, stderr_tee;
+
+  /* capacity of each pipe in bytes; 0 if not a pipe or not known */
+  size_t pipe_capacity[3];
+
+  /* stdin data waiting for the child */
+  input_queue stdin_;
+
+  /* drains stdout & stderr if requested in spawn options */
+  background_reader * reader;
+
+  /* bytes discarded by the background reader since last read */
+  size_t dropped;
+
+  /* readiness as seen by poll_processes() */
+  poll_state polling;
+
   process_handle_t ();
 
   ~process_handle_t () throw ()
@@ -215,20 +672,72 @@ struct process_handle_t {
     catch (...) {
       // TODO be silent or maybe show a warning?
     }
+    stop_reader();
+    stop_polling();
   }
 
   void spawn(const char * _command, char *const _arguments[],
 	                   char *const _environment[], const char * _workdir,
-                     termination_mode_type _termination_mode);
+                     termination_mode_type _termination_mode,
+                     const spawn_options & _options = spawn_options());
 
   void shutdown();
 
-  size_t write(const void * _buffer, size_t _count);
+  /**
+   * Open log files requested in `_options` and attach them to
+   * `stdout_` and `stderr_`; done by spawn() before the child is
+   * created.
+   */
+  void open_tees (const spawn_options & _options);
+
+  /**
+   * Write `_count` buffers to child's standard input, in order, with
+   * as few system calls as possible; whatever the child does not take
+   * within `_timeout` is queued. Not queued in Windows, where writes
+   * block until completed.
+   *
+   * @return Number of bytes accepted, which is the total length.
+   */
+  size_t write(const input_buffer * _buffers, size_t _count, int _timeout = TIMEOUT_INFINITE);
+
+  /**
+   * Queue `_length` bytes of file `_path`, starting at `_offset`, for
+   * child's standard input; a negative `_length` means up to the end
+   * of the file. The queue is then written out as in write(). In Linux
+   * data is moved into the pipe with splice(). In Windows the file is
+   * copied and the call blocks.
+   *
+   * @return Number of bytes queued.
+   */
+  size_t write_file(const char * _path, int64_t _offset, int64_t _length,
+                    int _timeout = TIMEOUT_IMMEDIATE);
 
-  size_t read(pipe_type _pipe, int _timeout);
+  size_t read(pipe_type _pipe, int _timeout, bool _flush = false, bool _binary = false);
 
   void close_input ();
 
+  /**
+   * Feed `_count` buffers of `_input` to child's standard input and
+   * close it, collecting both output streams in a single loop until
+   * they end, then wait for the child. Output accumulates in `stdout_`
+   * and `stderr_`. Input not written within `_timeout` is queued
+   * (discarded in Windows).
+   */
+  void communicate(const input_buffer * _input, size_t _count, int _timeout, bool _binary = false);
+
+  /**
+   * Read until `_stdout` finds its pattern in standard output and
+   * `_stderr` in standard error, either pipe ends or `_timeout`
+   * expires; a null matcher leaves its stream alone. Output
+   * accumulates in `stdout_` and `stderr_`; a stream is not read once
+   * matched and data past the end of a match is handed back and
+   * returned by the next read.
+   *
+   * @return true if all patterns have been found.
+   */
+  bool read_until(output_matcher * _stdout, output_matcher * _stderr, int _timeout,
+                  bool _binary = false);
+
   void wait(int _timeout);
 
   void terminate();
@@ -237,9 +746,274 @@ struct process_handle_t {
 
   void send_signal(int _signal);
 
+  void stop_reader();
+
+  void stop_polling();
+
 };
 
 
+/**
+ * Wait until any of the given processes has output to read, has
+ * closed both output streams or has exited.
+ *
+ * @param _handles Processes to wait for.
+ * @param _count Number of elements in `_handles`.
+ * @param _timeout Timeout in milliseconds.
+ * @param _ready Receives positions (in `_handles`) of processes which
+ *        are ready; must have room for `_count` elements. Details are
+ *        in each handle's `polling` member and `state`.
+ * @return Number of positions stored in `_ready`.
+ */
+size_t poll_processes (process_handle_t * const * _handles, size_t _count,
+                       int _timeout, size_t * _ready);
+
+
+/**
+ * Spawn `_count` children connected into a pipeline: stdout of each
+ * child is connected to stdin of the next one with a pipe R does not
+ * read from. `_options` set up stdin of the first child and stdout of
+ * the last one; stderr of all children goes to a single stream, which
+ * is the stderr pipe of the last child if a pipe is requested. The
+ * background reader and log files apply to the last child. Not
+ * supported in Windows.
+ *
+ * If a child cannot be started, children started so far are killed
+ * and the exception is rethrown.
+ */
+void spawn_pipeline (process_handle_t * const * _handles, size_t _count,
+                     const char * const * _commands, char ** const * _arguments,
+                     char *const _environment[], const char * _workdir,
+                     process_handle_t::termination_mode_type _termination_mode,
+                     const spawn_options & _options);
+
+
+/**
+ * Run `_command` in a POSIX shell which reads commands from its
+ * standard input. The command is followed by printing `_marker` to
+ * both output streams, together with the command's exit status on
+ * stdout, and output is read until both markers arrive. Markers are
+ * then cut off so that `stdout_` and `stderr_` hold only what the
+ * command printed. The command's standard input is `/dev/null`.
+ *
+ * @param _marker Letters, digits and underscores which do not appear
+ *        in output.
+ * @return Exit status of the command or -1 if the shell exited or
+ *         `_timeout` expired before the command completed.
+ */
+int shell_run (process_handle_t & _handle, const string & _command, const string & _marker,
+               int _timeout, bool _binary = false);
+
+
+/**
+ * Outcome of a single command run by run_parallel().
+ */
+struct job_result {
+  /** Everything the command printed before it exited. */
+  pipe_writer stdout_, stderr_;
+  /** EXITED or TERMINATED; NOT_STARTED if spawning failed. */
+  process_handle_t::process_state_type state;
+  /** Exit code, or the signal which terminated the child. */
+  int return_code;
+  /** The child was killed because it ran out of time. */
+  bool timed_out;
+  /** Why the command could not be started. */
+  string error;
+  /** Seconds since the Unix epoch. */
+  double start, end;
+
+  job_result ()
+    : state(process_handle_t::NOT_STARTED), return_code(0), timed_out(false),
+      start(0), end(0)
+  { }
+};
+
+
+/**
+ * Run `_count` commands, at most `_max_jobs` at a time, and collect
+ * their output. A single poll() loop watches output pipes and exit
+ * notifications of all running children; a job ends when its child
+ * exits, and the next command is spawned in its place right away.
+ * A child running longer than `_timeout` milliseconds is killed.
+ * Options apply to every child; the background reader is not used.
+ * Not supported in Windows.
+ *
+ * A command which cannot be started does not stop the others; its
+ * result carries the error message.
+ */
+void run_parallel (size_t _count, const char * const * _commands, char ** const * _arguments,
+                   char *const _environment[], const char * _workdir,
+                   process_handle_t::termination_mode_type _termination_mode,
+                   const spawn_options & _options, size_t _max_jobs, int _timeout,
+                   job_result * _results);
+
+
+/**
+ * A fixed number of long-lived workers, all running the same command,
+ * which read requests from their standard input and answer each one,
+ * in order, on their standard output. A request is either a single
+ * line or a frame: a 4-byte big-endian length followed by that many
+ * bytes; responses use the same protocol.
+ *
+ * A scheduler thread owns the pipes of all workers. Submitted requests
+ * are queued and sent to the worker with the fewest requests in
+ * flight, at most `_inflight` per worker; responses are matched with
+ * requests and kept until collected. The thread never spawns: a worker
+ * which exits is marked dead, requests sent to it fail, and it is
+ * replaced by restart(), which collect() calls. Standard error of
+ * workers must be redirected. Not supported in Windows.
+ */
+struct process_pool {
+
+  enum protocol_type { PROTOCOL_LINE, PROTOCOL_FRAME };
+
+  struct result {
+    uint64_t id;
+    size_t worker;
+    /** The worker exited before it answered. */
+    bool failed;
+    vector<char> data;
+  };
+
+  struct statistics {
+    uint64_t submitted, completed, failed, restarts;
+    /** Requests waiting for a worker and sent to workers. */
+    size_t queued, running;
+    /** Workers with nothing in flight, and all workers running. */
+    size_t idle, alive;
+    /** Results waiting to be collected. */
+    size_t ready;
+    /** Seconds since the pool was started. */
+    double elapsed;
+  };
+
+  process_pool (const char * _command, char *const _arguments[], char *const _environment[],
+                const char * _workdir, process_handle_t::termination_mode_type _termination_mode,
+                const spawn_options & _options, size_t _size, protocol_type _protocol,
+                size_t _inflight);
+
+  /** Stops the scheduler, closes input of workers and shuts them down. */
+  ~process_pool ();
+
+  process_pool (const process_pool &) = delete;
+  process_pool & operator = (const process_pool &) = delete;
+
+  /**
+   * Queue `_count` requests; their ids, consecutive numbers starting
+   * from 1, are written to `_ids`.
+   */
+  void submit (const input_buffer * _requests, size_t _count, uint64_t * _ids);
+
+  /**
+   * Move at most `_max` results to `_results`, waiting up to
+   * `_timeout` for the first one if there are none. Returns early if
+   * nothing is queued or running.
+   */
+  size_t collect (vector<result> & _results, size_t _max, int _timeout);
+
+  statistics stats ();
+
+  /** Start new workers in place of those which exited. */
+  size_t restart ();
+
+private:
+
+  struct state;
+  state * impl;
+};
+
+
+/**
+ * Output and exit of many children behind a single descriptor, for
+ * event loops which wait on descriptors, such as R's input handlers.
+ * fd() becomes readable when a watched pipe has data or has been
+ * closed, or a watched child has exited; pipes are level-triggered and
+ * stay ready until drained. Exit is watched through a duplicate of the
+ * pidfd, so reads and waits elsewhere do not hide it; children without
+ * pidfd are noticed through SIGCHLD. Supported only in Linux.
+ */
+struct event_watcher {
+
+  struct event {
+    process_handle_t * handle;
+    /** PIPE_STDOUT and/or PIPE_STDERR are ready to read. */
+    int pipes;
+    /** The child is not running any more; reported once. */
+    bool exited;
+  };
+
+  event_watcher ();
+
+  ~event_watcher ();
+
+  event_watcher (const event_watcher &) = delete;
+  event_watcher & operator = (const event_watcher &) = delete;
+
+  int fd () const;
+
+  /** Watch pipes in `_pipes` which have not reached their end yet. */
+  void watch_output (process_handle_t & _handle, pipe_type _pipes);
+
+  /** Watch exit; a child which is already gone is reported at once. */
+  void watch_exit (process_handle_t & _handle);
+
+  /** Must be called before pipes of `_handle` are closed. */
+  void forget (process_handle_t & _handle, pipe_type _pipes, bool _exit);
+
+  /** Collect events without waiting. */
+  void ready (vector<event> & _events);
+
+private:
+
+  struct state;
+  state * impl;
+};
+
+
+/**
+ * Start the fork server: a helper process which spawns children on
+ * behalf of R. Supported only in Linux.
+ *
+ * @return `false` if the server is already running.
+ */
+bool fork_server_start ();
+
+/**
+ * @return `false` if the server was not running.
+ */
+bool fork_server_stop ();
+
+bool fork_server_running ();
+
+#ifndef SUBPROCESS_WINDOWS
+/**
+ * Close all descriptors starting from 3 except those in `_keep`, which
+ * must be sorted. Does not allocate memory so it can be called between
+ * fork() and exec().
+ */
+void close_descriptors (const int * _keep, size_t _count);
+
+/**
+ * Spawn a child via the fork server. The child is a child of the
+ * calling process.
+ *
+ * @param _streams Descriptors to connect to child's stdin, stdout and
+ *        stderr, or HANDLE_CLOSED where a pipe should be created;
+ *        STDOUT_FILENO for stderr means "same as stdout".
+ * @param _pipes Receives the parent's ends of stdin, stdout, stderr;
+ *        HANDLE_CLOSED where no pipe was created.
+ * @return Pid of the child or -1 if the server is not available, in
+ *         which case errno is set; throws if the command cannot be run.
+ */
+pid_t fork_server_spawn (const char * _command, char *const _arguments[],
+                         char *const _environment[], const char * _workdir,
+                         process_handle_t::termination_mode_type _termination_mode,
+                         const int _streams[3],
+                         pipe_handle_type _pipes[3]);
+#endif
+
+
+
 
 } /* namespace subprocess */
 
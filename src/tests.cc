@@ -10,6 +10,10 @@
 #include <R.h>
 #include <Rdefines.h>
 
+#include <cstdio>
+#include <cstring>
+#include <string>
+
 
 #define expect_equal(a, b)                                     \
   do {                                                         \
@@ -22,6 +26,10 @@
 
 
 using subprocess::consume_utf8;
+using subprocess::consume_mbrtowc;
+
+
+static int test_consume_utf8_equivalence ();
 
 
 // ---------------------------------------------------------------------
@@ -39,6 +47,10 @@ extern "C" SEXP test_consume_utf8 ()
   expect_equal(consume_utf8("ab", 2), 2);
   expect_equal(consume_utf8("abc", 3), 3);
   expect_equal(consume_utf8("abcd", 4), 4);
+
+  // NUL bytes do not end the input
+  expect_equal(consume_utf8("a\0b", 3), 3);
+  expect_equal(consume_utf8("\0\0\0\0\0a", 6), 6);
   
   // multi-byte UTF8 characters; whole and split in the middle
   // https://en.wikipedia.org/wiki/UTF-8#Examples
@@ -54,11 +66,114 @@ extern "C" SEXP test_consume_utf8 ()
 
   // 𐍈 https://en.wikipedia.org/wiki/Hwair
 
- expect_equal(consume_utf8("a\xF0\x90\x8D\x88", 5), 5);
+  expect_equal(consume_utf8("a\xF0\x90\x8D\x88", 5), 5);
   expect_equal(consume_utf8("a\xF0\x90\x8D", 4), 1);
   expect_equal(consume_utf8("a\xF0\x90", 3), 1);
   expect_equal(consume_utf8("a\xF0", 2), 1);
   expect_equal(consume_utf8("a\xF0", 2), 1);
 
+  // every input must be consumed exactly as the reference mbrtowc()
+  // implementation does
+  errors += test_consume_utf8_equivalence();
+
   return allocate_single_int(errors);
 }
+
+
+// ---------------------------------------------------------------------
+
+/*
+ * Compare with consume_mbrtowc(); warn only about the first mismatch
+ * to keep the output readable.
+ */
+static int compare_with_reference (const char * _input, size_t _length, int & _mismatches)
+{
+  if (consume_utf8(_input, _length) == consume_mbrtowc(_input, _length)) {
+    return 0;
+  }
+
+  if (_mismatches++ == 0) {
+    std::string hex;
+    char byte[4];
+    for (size_t i = 0; i < _length && i < 16; ++i) {
+      snprintf(byte, sizeof(byte), "%02X ", (unsigned char)_input[i]);
+      hex += byte;
+    }
+    Rf_warning("consume_utf8 differs from mbrtowc() for input: %s", hex.c_str());
+  }
+  return 1;
+}
+
+
+static int test_consume_utf8_equivalence ()
+{
+  int mismatches = 0;
+  unsigned char input[128];
+
+  // all sequences of one, two and three bytes
+  for (size_t length = 1; length <= 3; ++length) {
+    for (unsigned long value = 0; value < (1UL << (8 * length)); ++value) {
+      for (size_t i = 0; i < length; ++i) {
+        input[i] = (unsigned char)(value >> (8 * i));
+      }
+      compare_with_reference((const char *)input, length, mismatches);
+    }
+  }
+
+  // four-byte sequences: all leading and second bytes, the remaining
+  // ones taken from the boundaries of continuation byte range
+  const unsigned char edges[] = { 0x00, 0x41, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xFF };
+  for (int lead = 0xC0; lead <= 0xFF; ++lead) {
+    for (int second = 0; second <= 0xFF; ++second) {
+      for (unsigned char third : edges) {
+        for (unsigned char fourth : edges) {
+          input[0] = lead; input[1] = second; input[2] = third; input[3] = fourth;
+          compare_with_reference((const char *)input, 4, mismatches);
+        }
+      }
+    }
+  }
+
+  // long inputs exercise the vectorized ASCII path; multi-byte and
+  // broken characters are put at every position of a 64-byte block,
+  // and every prefix of the block is verified
+  const char * pieces[] = { "\xC2\xA2", "\xE2\x82\xAC", "\xF0\x90\x8D\x88",
+                            "\xED\xA0\x80", "\xE0\x80", "\x80", "\n" };
+  for (const char * piece : pieces) {
+    size_t piece_length = strlen(piece);
+    for (size_t position = 0; position + piece_length <= 64; ++position) {
+      memset(input, 'a', 64);
+      memcpy(input + position, piece, piece_length);
+      for (size_t length = 0; length <= 64; ++length) {
+        compare_with_reference((const char *)input, length, mismatches);
+      }
+    }
+  }
+
+  // a NUL byte is consumed regardless of its position
+  for (size_t position = 0; position < 64; ++position) {
+    memset(input, 'a', 64);
+    input[position] = 0;
+    compare_with_reference((const char *)input, 64, mismatches);
+  }
+
+  // characters left to mbrtowc() - NUL and forms beyond the table that
+  // the C library might accept - followed by more multi-byte and
+  // broken characters, which must be verified the same way
+  const char * fallbacks[] = { "\0", "\xF4\x90\x80\x80", "\xF8\x88\x80\x80\x80",
+                               "\xFC\x84\x80\x80\x80\x80", "\xC0\xAF" };
+  const size_t fallback_lengths[] = { 1, 4, 5, 6, 2 };
+  for (size_t f = 0; f < sizeof(fallbacks)/sizeof(fallbacks[0]); ++f) {
+    for (const char * piece : pieces) {
+      size_t piece_length = strlen(piece);
+      for (size_t position = fallback_lengths[f]; position + piece_length <= 64; ++position) {
+        memset(input, 'a', 64);
+        memcpy(input, fallbacks[f], fallback_lengths[f]);
+        memcpy(input + position, piece, piece_length);
+        compare_with_reference((const char *)input, 64, mismatches);
+      }
+    }
+  }
+
+  return mismatches;
+}